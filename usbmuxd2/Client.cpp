@@ -11,16 +11,28 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
 #include "Muxer.hpp"
 #include "MUXException.hpp"
 #include "sysconf/sysconf.hpp"
+#include "TCP.hpp"
+#include <sys/uio.h>
+
+#ifdef MSG_NOSIGNAL
+#   define CLIENT_SEND_FLAGS MSG_NOSIGNAL
+#else
+#   define CLIENT_SEND_FLAGS 0 //SO_NOSIGPIPE is set on the socket instead
+#endif
+#define CLIENT_OUTQUEUE_IOV_MAX 64
 
 #pragma mark Client
 Client::Client(Muxer *mux, ClientManager *parent, int fd, uint64_t number)
 : _selfref{}, _mux(mux), _parent(parent)
-, _fd(fd), _number(number), _recvbuffer(NULL), _recvBytesCnt(0)
+, _fd(fd), _number(number), _recvbuffer(NULL), _recvBytesCnt(0), _recvOffset(0)
 , _proto_version(0),
-_isListening(false), _info{}
+_isListening(false), _connectTag(0), _isConnecting(false), _isDead(false), _info{}
+, _outqBytes(0), _outqSent(0), _wantsWrite(false)
 {
     debug("[Client] initializing Client %d",_fd);
     const int bufsize = Client::bufsize;
@@ -44,7 +56,6 @@ _isListening(false), _info{}
 
 Client::~Client(){
     debug("[Client] destroying Client %d",_fd);
-    stopLoop();
     {
         std::unique_lock<std::mutex> ul(_parent->_childrenLck);
         _parent->_children.erase(this);
@@ -54,45 +65,26 @@ Client::~Client(){
     
     safeClose(_fd);
     safeFree(_recvbuffer);
+    safeFree(_info.bundleID);
+    safeFree(_info.clientVersionString);
+    safeFree(_info.progName);
 }
 
-#pragma mark inheritance function
-void Client::stopAction() noexcept{
-    if (_fd > 0) shutdown(_fd, SHUT_RDWR);
-}
-
-void Client::afterLoop() noexcept{
-    _mux->delete_client(_selfref.lock());
-}
-
-bool Client::loopEvent(){
-    _recvBytesCnt = 0;
-    try {
-        recv_data();
-    } catch (tihmstar::MUXException_client_disconnected &e){
-        debug("Client disconnected, this is fine");
-        throw;
-    } catch (tihmstar::exception &e) {
-        error("failed to recv_data on client %d with error=%s code=%d",_fd,e.what(),e.code());
-#ifdef DEBUG
-        e.dump();
-#endif
-        throw; //immediately terminate this thread
-    }
-    return true;
-}
 #pragma mark private member function
+/*
+ Client info doesn't change over the lifetime of a client, the strings are copied from the first request carrying them
+ */
 void Client::update_client_info(const plist_t dict){
     plist_t node = NULL;
-    if ((node = plist_dict_get_item(dict, "ClientVersionString")) && (plist_get_node_type(node) == PLIST_STRING)) {
+    if (!_info.clientVersionString && (node = plist_dict_get_item(dict, "ClientVersionString")) && (plist_get_node_type(node) == PLIST_STRING)) {
         plist_get_string_val(node, &_info.clientVersionString);
     }
 
-    if ((node = plist_dict_get_item(dict, "BundleID")) && (plist_get_node_type(node) == PLIST_STRING)) {
+    if (!_info.bundleID && (node = plist_dict_get_item(dict, "BundleID")) && (plist_get_node_type(node) == PLIST_STRING)) {
         plist_get_string_val(node, &_info.bundleID);
     }
 
-    if ((node = plist_dict_get_item(dict, "ProgName")) && (plist_get_node_type(node) == PLIST_STRING)) {
+    if (!_info.progName && (node = plist_dict_get_item(dict, "ProgName")) && (plist_get_node_type(node) == PLIST_STRING)) {
         plist_get_string_val(node, &_info.progName);
     }
 
@@ -101,37 +93,80 @@ void Client::update_client_info(const plist_t dict){
     }
 }
 
-void Client::readData(){
+void Client::update_client_info(const PlistRequest &req){
+    auto intern = [](char *&dst, const PlistRequest::field<std::string_view> &f){
+        if (dst || !f.present) return;
+        dst = strndup(f.val.data(), f.val.size());
+    };
+    intern(_info.clientVersionString, req.clientVersionString);
+    intern(_info.bundleID, req.bundleID);
+    intern(_info.progName, req.progName);
+    if (req.kLibUSBMuxVersion.present) {
+        _info.kLibUSBMuxVersion = req.kLibUSBMuxVersion.val;
+    }
+}
+
+/*
+ returns false once there is nothing left to read without blocking
+ */
+bool Client::readData(){
     ssize_t got = 0;
-    size_t readsize = Client::bufsize-_recvBytesCnt;
+    size_t readsize = 0;
+    if (_recvOffset) {
+        //move the partial message to the front once per read, rather than once per processed message
+        _recvBytesCnt -= _recvOffset;
+        memmove(_recvbuffer, _recvbuffer+_recvOffset, _recvBytesCnt);
+        _recvOffset = 0;
+    }
+    readsize = Client::bufsize-_recvBytesCnt;
     retassure(readsize, "out of bufspace for client");
-    got = recv(_fd, _recvbuffer+_recvBytesCnt, readsize, 0);
+    got = recv(_fd, _recvbuffer+_recvBytesCnt, readsize, MSG_DONTWAIT);
     if (got == 0) {
         retcustomerror(MUXException_client_disconnected, "client %d disconnected!",_fd);
     }
-    assure(got > 0);
+    if (got < 0) {
+        retassure(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR, "recv failed on client %d with error=%d (%s)",_fd,errno,strerror(errno));
+        return false;
+    }
     _recvBytesCnt+=got;
+    return true;
 }
 
+/*
+ Called by ClientManager whenever the client socket is readable.
+ A single read may hold several pipelined requests, they are processed in order.
+ Partial messages stay buffered until the next read completes them.
+ */
 void Client::recv_data(){
-    const usbmuxd_header *hdr = (const usbmuxd_header*)_recvbuffer;
-    readData();
-
-    if (_recvBytesCnt < sizeof(usbmuxd_header)) {
-        readData();
-        retassure(_recvBytesCnt >= sizeof(struct usbmuxd_header), "message is too short for header");
-    }
-
-    while(_recvBytesCnt < hdr->length) {
-        readData();
-        retassure(_recvBytesCnt<Client::bufsize, "no more space to read");
-    }
-    processData(hdr);
+    bool didRead = false;
+    do {
+        didRead = readData();
+
+        while (_recvBytesCnt - _recvOffset >= sizeof(usbmuxd_header)) {
+            const usbmuxd_header *hdr = (const usbmuxd_header*)(_recvbuffer+_recvOffset);
+            uint32_t msglen = hdr->length;
+            retassure(msglen >= sizeof(usbmuxd_header) && msglen <= Client::bufsize, "invalid message length %u", msglen);
+            if (_recvBytesCnt - _recvOffset < msglen) break;
+
+            _recvOffset += msglen;
+            processData(hdr);
+
+            if (_recvOffset == _recvBytesCnt) _recvBytesCnt = _recvOffset = 0;
+            if (_isConnecting) {
+                //socket is about to be handed over to the connection
+                if (_recvBytesCnt) warning("Client %d sent %zu bytes after its connect request, they are not forwarded to the device", _fd, _recvBytesCnt - _recvOffset);
+                return;
+            }
+        }
+    } while (didRead);
 }
 
 void Client::processData(const usbmuxd_header *hdr){
     uint16_t portnum = 0;
     uint32_t device_id = 0;
+    uint64_t listen_generation = 0;
+    bool listen_since = false;
+    std::shared_ptr<const ListenFilter> listen_filter;
 
     std::string message;
 
@@ -157,6 +192,60 @@ void Client::processData(const usbmuxd_header *hdr){
             payload = (char*)(hdr) + sizeof(struct usbmuxd_header);
             payload_size = hdr->length - sizeof(struct usbmuxd_header);
 
+            {
+                //fast path for the frequent requests, those don't need a plist DOM
+                PlistRequest req;
+                if (req.parse(payload, payload_size) && req.cmd != PlistRequest::COMMAND_OTHER) {
+                    update_client_info(req);
+                    switch (req.cmd) {
+                        case PlistRequest::COMMAND_LISTEN:
+                            if (req.generation.present) {
+                                listen_generation = req.generation.val;
+                                listen_since = true;
+                            }
+                            goto PLIST_CLIENT_LISTEN_LOC;
+                        case PlistRequest::COMMAND_CONNECT:
+                            if (!req.deviceID.present) {
+                                error("Received connect request without device_id!");
+                                send_result(hdr->tag, RESULT_BADDEV);
+                                return;
+                            }
+                            if (!req.portNumber.present) {
+                                error("Received connect request without port number!");
+                                send_result(hdr->tag, RESULT_BADDEV);
+                                return;
+                            }
+                            device_id = (uint32_t)req.deviceID.val;
+                            portnum = ntohs((uint16_t)req.portNumber.val);
+                            goto PLIST_CLIENT_CONNECTION_LOC;
+                        case PlistRequest::COMMAND_LISTDEVICES:
+                            _mux->send_deviceList(_selfref.lock(), hdr->tag);
+                            return;
+                        case PlistRequest::COMMAND_LISTDEVICESSINCE:
+                            if (!req.generation.present) {
+                                error("Received ListDevicesSince request without generation!");
+                                send_result(hdr->tag, RESULT_BADCOMMAND);
+                                return;
+                            }
+                            _mux->send_deviceListSince(_selfref.lock(), hdr->tag, req.generation.val);
+                            return;
+                        case PlistRequest::COMMAND_READBUID:
+                            send_buid(hdr->tag);
+                            return;
+                        case PlistRequest::COMMAND_READPAIRRECORD:
+                            if (!req.pairRecordID.present) {
+                                error("Reading record id failed!");
+                                send_result(hdr->tag, EINVAL);
+                                return;
+                            }
+                            send_pair_record(hdr->tag, std::string(req.pairRecordID.val));
+                            return;
+                        default:
+                            break;
+                    }
+                }
+            }
+
             plist_from_xml(payload, payload_size, &p_recieved);
 
             {
@@ -174,6 +263,22 @@ void Client::processData(const usbmuxd_header *hdr){
             update_client_info(p_recieved);
 
             if (message == "Listen") {
+                plist_t p_intval = NULL;
+                plist_t p_filter = NULL;
+                if ((p_filter = plist_dict_get_item(p_recieved, "Filter"))) {
+                    try {
+                        listen_filter = std::make_shared<const ListenFilter>(p_filter);
+                    } catch (tihmstar::exception &e) {
+                        error("Received Listen request with invalid filter: %s", e.what());
+                        send_result(hdr->tag, RESULT_BADCOMMAND);
+                        return;
+                    }
+                }
+                //listeners which reconnect may pass the generation they've seen last
+                if ((p_intval = plist_dict_get_item(p_recieved, "Generation")) && (plist_get_node_type(p_intval) == PLIST_UINT)) {
+                    plist_get_uint_val(p_intval, &listen_generation);
+                    listen_since = true;
+                }
                 goto PLIST_CLIENT_LISTEN_LOC;
             } else if (message == "Connect") {
 
@@ -211,23 +316,24 @@ void Client::processData(const usbmuxd_header *hdr){
             } else if (message == "ListDevices") {
                 _mux->send_deviceList(_selfref.lock(), hdr->tag);
                 return;
+            } else if (message == "ListDevicesSince") {
+                uint64_t generation = 0;
+                try {
+                    plist_t p_intval = NULL;
+                    assure(p_intval = plist_dict_get_item(p_recieved, "Generation"));
+                    assure(plist_get_node_type(p_intval) == PLIST_UINT);
+                    plist_get_uint_val(p_intval, &generation);
+                } catch (tihmstar::exception &e) {
+                    error("Received ListDevicesSince request without generation!");
+                    send_result(hdr->tag, RESULT_BADCOMMAND);
+                    return;
+                }
+                _mux->send_deviceListSince(_selfref.lock(), hdr->tag, generation);
+                return;
             } else if (message == "ReadBUID") {
-                plist_t p_rsp = NULL;
-                cleanup([&]{
-                    safeFreeCustom(p_rsp, plist_free);
-                });
-                std::string buid = sysconf_get_system_buid();
-                p_rsp = plist_new_dict();
-                plist_dict_set_item(p_rsp, "BUID", plist_new_string(buid.c_str()));
-                send_plist_pkt(hdr->tag, p_rsp);
+                send_buid(hdr->tag);
                 return;
             } else if (message == "ReadPairRecord") {
-                plist_t p_devrecord = NULL;
-                plist_t p_rsp = NULL;
-                cleanup([&]{
-                    safeFreeCustom(p_devrecord, plist_free);
-                    safeFreeCustom(p_rsp, plist_free);
-                });
                 std::string record_id;
                 plist_t p_recordid = NULL;
 
@@ -245,26 +351,7 @@ void Client::processData(const usbmuxd_header *hdr){
                     send_result(hdr->tag, EINVAL);
                     return;
                 }
-
-                try {
-                    p_devrecord = sysconf_get_device_record(record_id.c_str());
-                } catch (tihmstar::exception &e) {
-                    info("no record data found for device %s",record_id.c_str());
-                    send_result(hdr->tag, ENOENT);
-                    return;
-                }
-
-                p_rsp = plist_new_dict();
-                {
-                    char *plistbin = NULL;
-                    cleanup([&]{
-                        safeFree(plistbin);
-                    });
-                    uint32_t plistbin_len = 0;
-                    plist_to_bin(p_devrecord, &plistbin, &plistbin_len);
-                    plist_dict_set_item(p_rsp, "PairRecordData", plist_new_data(plistbin, plistbin_len));
-                }
-                send_plist_pkt(hdr->tag, p_rsp);
+                send_pair_record(hdr->tag, record_id);
                 return;
             } else if (message == "SavePairRecord") {
                 plist_t p_parsedPairRecord = NULL;
@@ -353,6 +440,7 @@ void Client::processData(const usbmuxd_header *hdr){
         {
             const struct usbmuxd_connect_request *conn_req = NULL; //not allocated
 
+            retassure(hdr->length >= sizeof(struct usbmuxd_connect_request), "Client %d sent truncated connect request", _fd);
             conn_req = (usbmuxd_connect_request*)hdr;
             portnum = conn_req->port;
             device_id = conn_req->device_id;
@@ -367,35 +455,203 @@ void Client::processData(const usbmuxd_header *hdr){
 
 PLIST_CLIENT_CONNECTION_LOC:
     debug("Client %d connection request to device %d port %d", _fd, device_id, portnum);
+    //socket ownership goes to the device once it accepted the connection
+    _connectTag = hdr->tag;
+    _isConnecting = true;
+    _parent->disarm_client(this);
     try {
-        //transfer socket ownership to device!
-        _connectTag = hdr->tag;
         _mux->start_connect(device_id, portnum, _selfref.lock());
     } catch (tihmstar::exception &e) {
 #ifdef DEBUG
         e.dump();
 #endif
+        _isConnecting = false;
+        _parent->arm_client(_selfref.lock());
         send_result(hdr->tag, RESULT_CONNREFUSED);
         return;
     }
-    reterror("graceful kill");
+    return;
 
 PLIST_CLIENT_LISTEN_LOC:
-    send_result(hdr->tag, RESULT_OK);
-    debug("Client %d now LISTENING", _fd);
-    _isListening = true;
-    _mux->notify_alldevices(_selfref.lock()); //inform client about all connected devices
+    start_listening(hdr->tag, listen_filter);
+    if (!_isListening) return;
+    if (!listen_since || !_mux->notify_devices_since(_selfref.lock(), listen_generation)) {
+        _mux->notify_alldevices(_selfref.lock()); //inform client about all connected devices
+    }
     return;
 }
 
-void Client::writeData(struct usbmuxd_header *hdr, void *buf, size_t buflen){
+void Client::send_buid(uint32_t tag){
+    plist_t p_rsp = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_rsp, plist_free);
+    });
+    std::string buid = sysconf_get_system_buid();
+    p_rsp = plist_new_dict();
+    plist_dict_set_item(p_rsp, "BUID", plist_new_string(buid.c_str()));
+    send_plist_pkt(tag, p_rsp);
+}
+
+void Client::send_pair_record(uint32_t tag, const std::string &record_id){
+    plist_t p_rsp = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_rsp, plist_free);
+    });
+    std::shared_ptr<const std::string> plistbin;
+
+    try {
+        plistbin = sysconf_get_device_record_bin(record_id.c_str()); //encoded once and cached
+    } catch (tihmstar::exception &e) {
+        info("no record data found for device %s",record_id.c_str());
+        send_result(tag, ENOENT);
+        return;
+    }
+
+    p_rsp = plist_new_dict();
+    plist_dict_set_item(p_rsp, "PairRecordData", plist_new_data(plistbin->data(), plistbin->size()));
+    send_plist_pkt(tag, p_rsp);
+}
+
+/*
+ Writes as much of the queue as the socket takes without blocking.
+ returns true once the queue is empty
+ */
+bool Client::flush_outq_nolock(){
+    while (_outq.size()) {
+        struct iovec iov[CLIENT_OUTQUEUE_IOV_MAX];
+        struct msghdr msg = {};
+        size_t iovcnt = 0;
+        ssize_t didSend = 0;
+        for (auto &p : _outq) {
+            if (iovcnt == CLIENT_OUTQUEUE_IOV_MAX) break;
+            size_t skip = iovcnt ? 0 : _outqSent;
+            iov[iovcnt].iov_base = (void*)(p.pkt->data() + skip);
+            iov[iovcnt].iov_len = p.pkt->size() - skip;
+            iovcnt++;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        if ((didSend = sendmsg(_fd, &msg, MSG_DONTWAIT | CLIENT_SEND_FLAGS)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+            if (errno == EINTR) continue;
+            reterror("send failed on client %d with error=%d (%s)",_fd,errno,strerror(errno));
+        }
+        _outqBytes -= didSend;
+        didSend += _outqSent;
+        while (_outq.size() && (size_t)didSend >= _outq.front().pkt->size()) {
+            didSend -= _outq.front().pkt->size();
+            _outq.pop_front();
+        }
+        _outqSent = didSend;
+    }
+    return true;
+}
+
+/*
+ Makes room for a notification by dropping queued notifications about the same device which weren't started yet.
+ returns false if the new notification cancels out with what was dropped and doesn't need to be sent either
+ */
+bool Client::coalesce_outq_nolock(int deviceID, notify_kind kind) noexcept{
+    bool didDropAttached = false;
+    for (auto p = _outq.begin(); p != _outq.end();) {
+        if ((p == _outq.begin() && _outqSent) || p->kind == NOTIFY_NONE || p->deviceID != deviceID) {
+            p++;
+            continue;
+        }
+        if (p->kind == NOTIFY_ATTACHED) didDropAttached = true;
+        _outqBytes -= p->pkt->size();
+        p = _outq.erase(p);
+    }
+    //client never learns the device was there, so it doesn't need to learn that it's gone
+    return !(didDropAttached && kind == NOTIFY_DETACHED);
+}
+
+void Client::set_wants_write_nolock(bool wantsWrite){
+    if (_wantsWrite == wantsWrite) return;
+    _wantsWrite = wantsWrite;
+    _parent->update_client_interest(this);
+}
+
+/*
+ Called by ClientManager whenever the socket of a client with queued messages became writable.
+ Once the queue ran empty, a pending handover is completed.
+ */
+void Client::handle_writable(){
+    std::shared_ptr<TCP> conn;
+    {
+        std::unique_lock<std::mutex> ul(_wlock);
+        if (!flush_outq_nolock()) return;
+        set_wants_write_nolock(false);
+        conn = std::move(_handoverConn);
+    }
+    if (conn) {
+        _parent->disarm_client(this);
+        conn->complete_handover();
+    }
+}
+
+/*
+ Called by the connection right after the connect result was queued, never blocks.
+ returns false if everything was sent already and the socket can be taken over right away,
+ otherwise ClientManager hands the socket over once the client took its last messages.
+ */
+bool Client::begin_handover(std::shared_ptr<TCP> conn){
     std::unique_lock<std::mutex> ul(_wlock);
+    if (flush_outq_nolock()) return false;
+    _handoverConn = conn;
+    try {
+        _parent->arm_handover(_selfref.lock());
+    } catch (...) {
+        _handoverConn = nullptr;
+        throw;
+    }
+    return true;
+}
 
-    assure(send(_fd, hdr, sizeof(usbmuxd_header), 0) == sizeof(usbmuxd_header));
-    assure(send(_fd, buf, buflen, 0) == buflen);
+/*
+ The connection was already reported to the client, so the only way out is dropping it
+ */
+void Client::fail_handover() noexcept{
+    std::shared_ptr<TCP> conn;
+    {
+        std::unique_lock<std::mutex> ul(_wlock);
+        conn = std::move(_handoverConn);
+    }
+    if (conn) conn->kill(__LINE__);
 }
 
-void Client::send_pkt(uint32_t tag, enum usbmuxd_msgtype msg, void *payload, int payload_length){
+/*
+ Queues pkt and sends as much as possible right away, never blocks.
+ Once more than CLIENT_OUTQUEUE_MAX bytes are queued, the client has to be disconnected
+ unless coalescing notifications makes enough room.
+ returns false if the client has to be disconnected
+ */
+bool Client::enqueue_pkt_nolock(EncodedPlist::packet pkt, int deviceID, notify_kind kind){
+    retassure(_fd != -1, "client socket was handed over already");
+    if (_outqBytes + pkt->size() > CLIENT_OUTQUEUE_MAX) {
+        if (kind != NOTIFY_NONE && gConfig->clientOverflowCoalesce) {
+            if (!coalesce_outq_nolock(deviceID, kind)) return true;
+        }
+        if (_outqBytes + pkt->size() > CLIENT_OUTQUEUE_MAX) return false;
+    }
+    _outqBytes += pkt->size();
+    _outq.push_back({std::move(pkt), deviceID, kind});
+    set_wants_write_nolock(!flush_outq_nolock());
+    return true;
+}
+
+void Client::enqueue_pkt(EncodedPlist::packet pkt, int deviceID, notify_kind kind){
+    {
+        std::unique_lock<std::mutex> ul(_wlock);
+        if (enqueue_pkt_nolock(std::move(pkt), deviceID, kind)) return;
+    }
+    error("Client %d doesn't keep up with its messages (more than %d bytes queued), disconnecting",_fd,CLIENT_OUTQUEUE_MAX);
+    _mux->delete_client(_selfref.lock());
+    reterror("client %d overflowed its queue",_fd);
+}
+
+EncodedPlist::packet Client::make_pkt(uint32_t tag, enum usbmuxd_msgtype msg, const void *payload, int payload_length){
+    std::string pkt;
     struct usbmuxd_header hdr{
         .length = (uint32_t)(sizeof(hdr) + payload_length),
         .version = _proto_version,
@@ -403,10 +659,13 @@ void Client::send_pkt(uint32_t tag, enum usbmuxd_msgtype msg, void *payload, int
         .tag = tag
     };
     debug("send_pkt fd %d tag %d msg %d payload_length %d", _fd, tag, msg, payload_length);
-    writeData(&hdr, payload, payload_length);
+    pkt.reserve(hdr.length);
+    pkt.append((const char*)&hdr, sizeof(hdr));
+    pkt.append((const char*)payload, payload_length);
+    return std::make_shared<const std::string>(std::move(pkt));
 }
 
-void Client::send_plist_pkt(uint32_t tag, plist_t plist){
+EncodedPlist::packet Client::make_plist_pkt(uint32_t tag, plist_t plist){
     char *xml = NULL;
     cleanup([&]{
         safeFree(xml);
@@ -414,10 +673,10 @@ void Client::send_plist_pkt(uint32_t tag, plist_t plist){
     uint32_t xmlsize = 0;
 
     plist_to_xml(plist, &xml, &xmlsize);
-    send_pkt(tag, MESSAGE_PLIST, xml, xmlsize);
+    return make_pkt(tag, MESSAGE_PLIST, xml, xmlsize);
 }
 
-void Client::send_result(uint32_t tag, uint32_t result){
+EncodedPlist::packet Client::make_result_pkt(uint32_t tag, uint32_t result){
     if (_proto_version == 1) {
         plist_t dict = NULL;
         cleanup([&]{
@@ -427,10 +686,62 @@ void Client::send_result(uint32_t tag, uint32_t result){
         dict = plist_new_dict();
         plist_dict_set_item(dict, "MessageType", plist_new_string("Result"));
         plist_dict_set_item(dict, "Number", plist_new_uint(result));
-        send_plist_pkt(tag, dict);
+        return make_plist_pkt(tag, dict);
     } else {
         /* binary packet */
-        send_pkt(tag, MESSAGE_RESULT, &result, sizeof(uint32_t));
+        return make_pkt(tag, MESSAGE_RESULT, &result, sizeof(uint32_t));
+    }
+}
+
+void Client::send_pkt(uint32_t tag, enum usbmuxd_msgtype msg, void *payload, int payload_length){
+    enqueue_pkt(make_pkt(tag, msg, payload, payload_length));
+}
+
+void Client::send_plist_pkt(uint32_t tag, plist_t plist){
+    enqueue_pkt(make_plist_pkt(tag, plist));
+}
+
+void Client::send_result(uint32_t tag, uint32_t result){
+    enqueue_pkt(make_result_pkt(tag, result));
+}
+
+/*
+ Registers the client as listener and queues OK in front of any notification.
+ Notifications for us wait on _wlock until OK is queued, so the client never sees one before the result.
+ If the client can't be registered, it gets an error and stays in command state.
+ */
+void Client::start_listening(uint32_t tag, std::shared_ptr<const ListenFilter> filter){
+    EncodedPlist::packet okPkt = make_result_pkt(tag, RESULT_OK);
+    {
+        std::unique_lock<std::mutex> ul(_wlock);
+        try {
+            _mux->add_listener(_selfref.lock(), filter);
+        } catch (tihmstar::exception &e) {
+            ul.unlock();
+            error("Failed to register client %d as listener: %s", _fd, e.what());
+            send_result(tag, RESULT_BADCOMMAND);
+            return;
+        }
+        if (!enqueue_pkt_nolock(okPkt, 0, NOTIFY_NONE)) {
+            ul.unlock();
+            error("Client %d doesn't keep up with its messages (more than %d bytes queued), disconnecting",_fd,CLIENT_OUTQUEUE_MAX);
+            _mux->delete_client(_selfref.lock());
+            reterror("client %d overflowed its queue",_fd);
+        }
+    }
+    _isListening = true;
+    debug("Client %d now LISTENING", _fd);
+}
+
+void Client::connect_refused() noexcept{
+    debug("Client %d connection request was refused", _fd);
+    try {
+        _isConnecting = false;
+        _parent->arm_client(_selfref.lock());
+        send_result(_connectTag, RESULT_CONNREFUSED);
+    } catch (tihmstar::exception &e) {
+        error("failed to return client %d to command state with error=%s code=%d",_fd,e.what(),e.code());
+        _mux->delete_client(_selfref.lock());
     }
 }
 
@@ -444,6 +755,11 @@ void Client::kill() noexcept{
 void Client::deconstruct() noexcept{
     debug("[Client] deconstructing Client %d",_fd);
     std::shared_ptr<Client> selfref = _selfref.lock();
+    _isDead = true;
     _mux->delete_client(selfref);
-    stopLoop();
+    _parent->disarm_client(this);
+    {
+        std::unique_lock<std::mutex> ul(_wlock);
+        _handoverConn = nullptr; //connection and client don't keep each other alive
+    }
 }
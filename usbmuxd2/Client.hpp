@@ -10,13 +10,21 @@
 
 #include "usbmuxd2-proto.h"
 #include "Manager/ClientManager.hpp"
-#include <libgeneral/Manager.hpp>
+#include "EncodedPlist.hpp"
+#include "ListenFilter.hpp"
+#include "PlistRequest.hpp"
 #include <libgeneral/Event.hpp>
 #include <plist/plist.h>
 #include <memory>
+#include <atomic>
+#include <deque>
+
+#define CLIENT_OUTQUEUE_MAX 0x100000    //bytes queued for a client before its overflow policy kicks in
+#define CLIENT_DRAIN_TIMEOUT_MS 1000    //how long a client may take to accept its last messages before its socket is handed over
 
 class Muxer;
-class Client : public tihmstar::Manager{
+class TCP;
+class Client {
 public:
     static constexpr int bufsize = 0x20000;
     struct cinfo{
@@ -25,6 +33,12 @@ public:
         char *progName;
         uint64_t kLibUSBMuxVersion;
     };
+    enum notify_kind {
+        NOTIFY_NONE = 0,      // reply or anything else which must not be dropped
+        NOTIFY_ATTACHED,
+        NOTIFY_DETACHED,
+        NOTIFY_PAIRED
+    };
     enum state {
         CLIENT_COMMAND,        // waiting for command
         CLIENT_LISTEN,         // listening for devices
@@ -40,30 +54,54 @@ private:
 
     char *_recvbuffer;
     size_t _recvBytesCnt;
+    size_t _recvOffset;     //start of the first unprocessed message in _recvbuffer
     uint32_t _proto_version;
     bool _isListening;
+    std::shared_ptr<const ListenFilter> _listenFilter;  //nullptr if the client gets every notification, changed by Muxer::add_listener
     uint32_t _connectTag;
+    std::atomic<bool> _isConnecting; //socket is parked until the device answered the connect request
+    std::atomic<bool> _isDead;
     cinfo _info;
+    struct out_pkt{
+        EncodedPlist::packet pkt;
+        int deviceID;                   //device a notification is about
+        notify_kind kind;
+    };
     std::mutex _wlock;
-
-#pragma mark inheritance function
-    virtual void stopAction() noexcept override;
-    virtual void afterLoop() noexcept override;
-    virtual bool loopEvent() override;
+    std::deque<out_pkt> _outq;          //guarded by _wlock
+    size_t _outqBytes;                  //guarded by _wlock
+    size_t _outqSent;                   //part of _outq.front() which was sent already, guarded by _wlock
+    std::atomic<bool> _wantsWrite;      //changed with _wlock held
+    std::shared_ptr<TCP> _handoverConn; //connection waiting for the socket until the client took its last messages, guarded by _wlock
 
 
 #pragma mark private member function
     void update_client_info(const plist_t dict);
+    void update_client_info(const PlistRequest &req);
 
-    void readData();
+    bool readData();
     void recv_data();
 
     void processData(const usbmuxd_header *hdr);
+    void send_buid(uint32_t tag);
+    void send_pair_record(uint32_t tag, const std::string &record_id);
 
-    void writeData(struct usbmuxd_header *hdr, void *buf, size_t buflen);
+    bool flush_outq_nolock();
+    bool coalesce_outq_nolock(int deviceID, notify_kind kind) noexcept;
+    void set_wants_write_nolock(bool wantsWrite);
+    void handle_writable();
+    bool begin_handover(std::shared_ptr<TCP> conn);
+    void fail_handover() noexcept;
+    bool enqueue_pkt_nolock(EncodedPlist::packet pkt, int deviceID, notify_kind kind);
+    void enqueue_pkt(EncodedPlist::packet pkt, int deviceID = 0, notify_kind kind = NOTIFY_NONE);
+    EncodedPlist::packet make_pkt(uint32_t tag, usbmuxd_msgtype msg, const void *payload, int payload_length);
+    EncodedPlist::packet make_plist_pkt(uint32_t tag, plist_t plist);
+    EncodedPlist::packet make_result_pkt(uint32_t tag, uint32_t result);
     void send_pkt(uint32_t tag, usbmuxd_msgtype msg, void *payload, int payload_length);
     void send_plist_pkt(uint32_t tag, plist_t plist);
     void send_result(uint32_t tag, uint32_t result);
+    void start_listening(uint32_t tag, std::shared_ptr<const ListenFilter> filter);
+    void connect_refused() noexcept;
 
 public:
     Client(Muxer *mux, ClientManager *parent, int fd, uint64_t number);
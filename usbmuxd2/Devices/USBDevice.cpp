@@ -9,6 +9,7 @@
 #include "../Muxer.hpp"
 #include "../Manager/USBDeviceManager.hpp"
 #include "TCP.hpp"
+#include "../sysconf/sysconf.hpp"
 
 #include <libgeneral/macros.h>
 
@@ -16,9 +17,25 @@
 
 #include <string.h>
 
+extern Config *gConfig;
+
+static_assert(RX_REORDER_RING_SIZE > RX_BUFFER_MAX, "every RX buffer needs to fit into the reorder ring");
+
+/*
+ Bounds for RX transfers in flight and TX batching, picked by USB speed.
+ Slow devices keep batches short, so a single transfer doesn't stall the bus for long,
+ fast ones may grow their RX depth while the measured throughput keeps improving.
+ */
+static const USBDevice::speed_profile gSpeedProfiles[] = {
+    //minSpeed          rxDepthMin  rxDepthMax      txInflightMax       txBatchMax
+    {5000000000ULL,     4,          RX_DEPTH_MAX,   TX_XFER_RING_SIZE,  USB_MTU},   //SuperSpeed
+    {480000000ULL,      3,          8,              16,                 USB_MTU},   //HighSpeed
+    {0,                 1,          2,              4,                  0x1000},    //FullSpeed, LowSpeed
+};
+
 #pragma mark libusb_callback implementations
 void tx_callback(struct libusb_transfer *xfer) noexcept{
-    std::shared_ptr<USBDevice> dev = *(std::shared_ptr<USBDevice> *)xfer->user_data;
+    USBDevice *dev = (USBDevice *)xfer->user_data; //kept alive by dev->_tx_pin until tx_xfer_put
 
     if(xfer->status != LIBUSB_TRANSFER_COMPLETED) {
         switch(xfer->status) {
@@ -51,18 +68,13 @@ void tx_callback(struct libusb_transfer *xfer) noexcept{
         dev->kill();
     }
 
-    //remove transfer
-    {
-        guardWrite(dev->_tx_xfers_Guard);
-        dev->_tx_xfers.erase(xfer);
-    }
-
-    safeFree(xfer->buffer);
-    {
-        std::shared_ptr<USBDevice> *userarg = (std::shared_ptr<USBDevice> *)xfer->user_data;xfer->user_data = NULL;
-        safeDelete(userarg);
+    //recycle transfer
+    if (xfer->length) {
+        //ZLPs don't carry a pooled buffer
+        dev->tx_buffer_put(xfer->buffer);
     }
-    libusb_free_transfer(xfer);
+    xfer->buffer = NULL;
+    dev->tx_xfer_put(xfer);
 }
 
 #pragma mark USBDevice
@@ -75,12 +87,35 @@ USBDevice::USBDevice(Muxer *mux, USBDeviceManager *parent, uint16_t pid)
 , _wMaxPacketSize(0), _speed(0)
 , _state{}, _usbdev(NULL), _nextPort(0)
 , _muxdev{}, _usbLck{}
-, _rx_xfers{}, _tx_xfers{}
+, _rx_stash{}, _rx_draining(false), _rx_stashStop(false)
+, _rx_xfers{}, _rx_depthMin(1), _rx_depthMax(1), _rx_stat{}
+, _tx_ring{}, _tx_free{}, _tx_inflight(0), _tx_inflightMax(TX_XFER_RING_SIZE), _tx_reserved(0), _tx_stopping(false), _tx_bufpool{}
+, _tx_credit(0), _tx_batch(NULL), _tx_batchLen(0), _tx_batchMax(USB_MTU), _tx_batchStop(false)
+, _connPages{}, _portBits{}, _portWordsFull{}, _connsCnt(0)
 {
+    _portBits[0] = 1; //port 0 is never handed out
     retassure(_muxdev.pktbuf = (uint8_t*)malloc(DEV_MRU), "Failed to alloc pktbuf");
+    _tx_bufpool.reserve(TX_BUFFER_POOL_SIZE);
+    _rx_bufs.reserve(RX_BUFFER_MAX);
+    _rx_bufpool.reserve(RX_BUFFER_MAX);
+    _tx_ring.reserve(TX_XFER_RING_SIZE+TX_XFER_SPILL_MAX);
+    _tx_free.reserve(TX_XFER_RING_SIZE+TX_XFER_SPILL_MAX);
+    for (int i=0; i<TX_XFER_RING_SIZE+TX_XFER_SPILL_MAX; i++) {
+        struct libusb_transfer *xfer = NULL;
+        if (!(xfer = libusb_alloc_transfer(0))) {
+            for (auto x : _tx_ring) libusb_free_transfer(x);
+            safeFree(_muxdev.pktbuf);
+            reterror("Failed to alloc TX transfer");
+        }
+        _tx_ring.push_back(xfer);
+        _tx_free.push_back(xfer);
+    }
     _conReaperThread = std::thread([this]{
         reaper_runloop();
     });
+    _txFlushThread = std::thread([this]{
+        tx_flush_runloop();
+    });
 
 }
 
@@ -103,8 +138,21 @@ USBDevice::~USBDevice(){
     
     _reapConnections.kill();
     _conReaperThread.join();
+    tx_flush_stop();
     
     safeFree(_muxdev.pktbuf);
+    for (auto buf : _rx_bufs) free(buf);
+    _rx_bufs.clear();
+    _rx_bufpool.clear();
+    for (auto buf : _tx_bufpool) free(buf);
+    _tx_bufpool.clear();
+    for (auto xfer : _tx_ring) libusb_free_transfer(xfer);
+    _tx_ring.clear();
+    _tx_free.clear();
+    for (auto &page : _connPages) {
+        conn_slot *p = page.exchange(nullptr);
+        delete [] p;
+    }
     //free resources
     if (_usbdev){
         libusb_release_interface(_usbdev, _interface);
@@ -115,33 +163,385 @@ USBDevice::~USBDevice(){
 
 #pragma mark private
 bool USBDevice::isDeviceReadyForDestruction(){
-    return _rx_xfers.size() == 0 && _tx_xfers.size() == 0;
+    return _rx_xfers.size() == 0 && _tx_inflight == 0;
 }
 
 void USBDevice::addReceiver(){
+    if (_receivers.size() >= NUM_RX_LOOPS) return; //more receivers don't help, only one of them parses at a time
     _receivers.insert(new USBDevice_receiver(this));
 }
 
+/*
+ needs to be called once _speed is known, before any transfers are started
+ */
+void USBDevice::apply_speed_profile() noexcept{
+    const speed_profile *p = gSpeedProfiles;
+    while (_speed < p->minSpeed) p++; //last profile matches any speed
+    _rx_depthMax = p->rxDepthMax;
+    if (gConfig && gConfig->usbRxDepthMax && gConfig->usbRxDepthMax < _rx_depthMax) {
+        _rx_depthMax = gConfig->usbRxDepthMax;
+    }
+    _rx_depthMin = (p->rxDepthMin < _rx_depthMax) ? p->rxDepthMin : _rx_depthMax;
+    _tx_inflightMax = p->txInflightMax;
+    _tx_batchMax = p->txBatchMax;
+    _rx_stat.cap = _rx_depthMax;
+    _rx_stat.start = std::chrono::steady_clock::now();
+    debug("Device %d-%d uses %u-%u RX transfers, %zu TX transfers of up to %zu bytes",_bus,_address,_rx_depthMin,_rx_depthMax,_tx_inflightMax,_tx_batchMax);
+}
+
+/*
+ Called by the libusb event thread for every completed RX transfer.
+ While the device streams large packets, RX transfers are added one at a time for as long as
+ each one raises throughput by at least RX_ADAPT_GAIN_PERCENT. Once the bulk transfer is over
+ or the device takes long to fill transfers, depth falls back towards _rx_depthMin.
+ Returns 1 if another RX transfer should be started, -1 if the completed one should be retired, 0 otherwise.
+ */
+int USBDevice::rx_adapt(uint32_t length, std::chrono::steady_clock::duration latency, bool parserBehind) noexcept{
+    auto now = std::chrono::steady_clock::now();
+    auto interval = now - _rx_stat.start;
+    int ret = 0;
+    size_t depth = 0;
+    uint64_t rate = 0;
+    bool isBulk = false;
+
+    _rx_stat.cnt++;
+    _rx_stat.bytes += length;
+    _rx_stat.latency += latency;
+    if (length >= USB_MRU/2) _rx_stat.large++;
+    if (parserBehind) _rx_stat.stalled++;
+    if (interval < std::chrono::milliseconds(RX_ADAPT_INTERVAL_MS)) return 0;
+
+    {
+        guardRead(_rx_xfers_Guard);
+        depth = _rx_xfers.size();
+    }
+    rate = _rx_stat.bytes * 1000 / (std::chrono::duration_cast<std::chrono::milliseconds>(interval).count() + 1);
+    //mostly large packets which the device hands out faster than we poll, while the parser keeps up
+    isBulk = _rx_stat.large*2 >= _rx_stat.cnt && !_rx_stat.stalled
+            && _rx_stat.latency / _rx_stat.cnt < std::chrono::milliseconds(RX_ADAPT_INTERVAL_MS) / 4;
+
+    if (isBulk) {
+        if (_rx_stat.probeRate && rate * 100 < _rx_stat.probeRate * (100 + RX_ADAPT_GAIN_PERCENT)) {
+            //the last transfer we added didn't pay off, don't try that depth again during this bulk transfer
+            _rx_stat.cap = (unsigned)depth - 1;
+            if (depth > _rx_depthMin) ret = -1;
+            _rx_stat.probeRate = 0;
+        } else if (depth < _rx_stat.cap) {
+            _rx_stat.probeRate = rate;
+            ret = 1;
+        } else {
+            _rx_stat.probeRate = 0;
+        }
+    } else {
+        _rx_stat.cap = _rx_depthMax;
+        _rx_stat.probeRate = 0;
+        if (depth > _rx_depthMin) ret = -1;
+    }
+    if (ret) {
+        debug("Device %d-%d RX at %llu KB/s with %zu transfers, %s one",_bus,_address,(unsigned long long)(rate/1024),depth,(ret > 0) ? "adding" : "retiring");
+    }
+
+    _rx_stat.start = now;
+    _rx_stat.bytes = 0;
+    _rx_stat.cnt = 0;
+    _rx_stat.large = 0;
+    _rx_stat.stalled = 0;
+    _rx_stat.latency = {};
+    return ret;
+}
+
+/*
+ Submits buf on a free TX descriptor, buf belongs to the transfer once this returned.
+ Called with _usbLck held, so this only waits if even the spill descriptors are in flight.
+ Data goes out on descriptors its sender reserved beforehand,
+ everything else may use whatever is free beyond the reservations.
+ */
+void USBDevice::tx_xfer_submit(unsigned char *buf, size_t length){
+    struct libusb_transfer *xfer = NULL;
+    int ret = 0;
+    std::unique_lock<std::mutex> ul(_tx_ringLck);
+    while (true) {
+        retassure(!_tx_stopping, "Device %d-%d is going away",_bus,_address);
+        if (_tx_credit) {
+            //reserved descriptors are always free
+            _tx_credit--;
+            _tx_reserved--;
+            break;
+        }
+        if (_tx_free.size() > _tx_reserved) break;
+        uint64_t wevent = _tx_ringEvent.getNextEvent();
+        ul.unlock();
+        _tx_ringEvent.waitForEvent(wevent);
+        ul.lock();
+    }
+    xfer = _tx_free.back();
+    _tx_free.pop_back();
+    //submitted under _tx_ringLck, so anything not in _tx_free is safe to cancel
+    libusb_fill_bulk_transfer(xfer, _usbdev, _ep_out, buf, (int)length, tx_callback, this, 0);
+    if ((ret = libusb_submit_transfer(xfer)) < 0) {
+        xfer->buffer = NULL;
+        _tx_free.push_back(xfer);
+        reterror("Failed to submit TX transfer len %zu to device %d-%d: %d", length, _bus, _address, ret);
+    }
+    if (_tx_inflight++ == 0) {
+        _tx_pin = _selfref.lock();
+    }
+}
+
+void USBDevice::tx_xfer_put(struct libusb_transfer *xfer) noexcept{
+    std::shared_ptr<USBDevice> pin; //release pin only after unlocking, this may be the last reference to us
+    {
+        std::unique_lock<std::mutex> ul(_tx_ringLck);
+        _tx_free.push_back(xfer); //never reallocates, capacity is reserved in constructor
+        if (--_tx_inflight == 0) {
+            pin = std::move(_tx_pin);
+        }
+        _tx_ringEvent.notifyAll();
+    }
+}
+
+/*
+ Data senders call this before taking any lock and pass reserved to send_packet_inplace.
+ Waits while _tx_inflightMax descriptors are in flight or promised,
+ returns false if the device is going away.
+ */
+bool USBDevice::tx_reserve(size_t cnt) noexcept{
+    std::unique_lock<std::mutex> ul(_tx_ringLck);
+    while (_tx_inflight + _tx_reserved + cnt > _tx_inflightMax) {
+        if (_tx_stopping) return false;
+        uint64_t wevent = _tx_ringEvent.getNextEvent();
+        ul.unlock();
+        _tx_ringEvent.waitForEvent(wevent);
+        ul.lock();
+    }
+    _tx_reserved += cnt;
+    return true;
+}
+
+void USBDevice::tx_unreserve(size_t cnt) noexcept{
+    if (!cnt) return;
+    std::unique_lock<std::mutex> ul(_tx_ringLck);
+    _tx_reserved -= cnt;
+    _tx_ringEvent.notifyAll();
+}
+
+/*
+ Packets are coalesced into one bulk transfer while the bus is busy.
+ The batch is flushed when it is full, once TX_COALESCE_DEADLINE_US passed,
+ or right away if there is no other TX transfer in flight.
+ Always consumes buf
+ */
+void USBDevice::tx_enqueue_nolock(unsigned char *buf, size_t length){
+    cleanup([&]{
+        tx_buffer_put(buf);
+    });
+    bool busIdle = false;
+
+    if (_tx_batchStop || _muxdev.version < 2 || length > TX_COALESCE_MAX_PACKET) {
+        //mux v1 doesn't support multiple packets per transfer, large packets go out without copying
+        tx_batch_flush_nolock();
+        unsigned char *sendbuf = buf; buf = NULL; //consumed by usb_send in any case
+        usb_send(sendbuf, length);
+        return;
+    }
+
+    if (_tx_batch && _tx_batchLen + length <= _tx_batchMax) {
+        memcpy(_tx_batch + _tx_batchLen, buf, length);
+        _tx_batchLen += length;
+    } else {
+        tx_batch_flush_nolock();
+        //the packet already sits at the start of its buffer, so it becomes the new batch
+        _tx_batch = buf; buf = NULL;
+        _tx_batchLen = length;
+        _tx_batchDeadline = std::chrono::steady_clock::now() + std::chrono::microseconds(TX_COALESCE_DEADLINE_US);
+        _tx_batchCond.notify_one();
+    }
+
+    {
+        std::unique_lock<std::mutex> ul(_tx_ringLck);
+        busIdle = (_tx_inflight == 0);
+    }
+    if (busIdle || _tx_batchLen + sizeof(mux_header_v2) + sizeof(tcphdr) > _tx_batchMax) {
+        tx_batch_flush_nolock();
+    }
+}
+
+void USBDevice::tx_batch_flush_nolock(){
+    unsigned char *buf = _tx_batch; _tx_batch = NULL;
+    size_t length = _tx_batchLen; _tx_batchLen = 0;
+    if (!buf) return;
+    usb_send(buf, length);
+}
+
+void USBDevice::tx_flush_runloop(){
+    std::unique_lock<std::mutex> ul(_usbLck);
+    while (!_tx_batchStop) {
+        if (!_tx_batch) {
+            _tx_batchCond.wait(ul);
+            continue;
+        }
+        if (std::chrono::steady_clock::now() < _tx_batchDeadline) {
+            _tx_batchCond.wait_until(ul, _tx_batchDeadline);
+            continue;
+        }
+        {
+            //the batch is data, wait for a descriptor without blocking senders
+            bool didReserve = false;
+            ul.unlock();
+            didReserve = tx_reserve(1);
+            ul.lock();
+            if (!didReserve) continue;
+        }
+        _tx_credit = 1;
+        try {
+            tx_batch_flush_nolock(); //the batch may be gone already, then the reservation is unused
+        } catch (tihmstar::exception &e) {
+            debug("failed to flush TX batch to usbdevice(%p) error=%s code=%d",this,e.what(),e.code());
+            kill();
+        }
+        tx_unreserve(_tx_credit);
+        _tx_credit = 0;
+    }
+    //whatever is left at this point won't be sent anymore, later packets bypass the batch
+    tx_buffer_put(_tx_batch); _tx_batch = NULL;
+    _tx_batchLen = 0;
+}
+
+/*
+ Also ends TX submissions, so nothing is submitted behind the cancellation in deconstruct
+ */
+void USBDevice::tx_flush_stop() noexcept{
+    {
+        std::unique_lock<std::mutex> ul(_usbLck);
+        _tx_batchStop = true;
+        _tx_batchCond.notify_all();
+    }
+    {
+        std::unique_lock<std::mutex> ul(_tx_ringLck);
+        _tx_stopping = true;
+        _tx_ringEvent.notifyAll();
+    }
+    if (_txFlushThread.joinable()) _txFlushThread.join();
+}
+
 void USBDevice::reaper_runloop(){
     while (true) {
         uint16_t conport = 0;
+        conn_slot *slot = NULL;
+        std::shared_ptr<TCP> conn;
         try {
             conport = _reapConnections.wait();
         } catch (...) {
             break;
         }
         {
-            guardWrite(_conns_Guard);
-            auto cp = _conns.find(conport);
-            if (cp != _conns.end()){
-                cp->second->deconstruct();
-            }
-            _conns.erase(conport);
+            std::unique_lock<std::mutex> ul(_connsLck);
+            if (!(slot = conn_slot_get(conport)) || !slot->owner) continue; //already reaped
+            conn = std::move(slot->owner);
+            slot->conn = nullptr; //unpublish, new packets for this port get RST from now on
+        }
+        conn->deconstruct();
+        while (slot->readers) {
+            //RX thread is still in handle_input
+            std::this_thread::yield();
+        }
+        {
+            std::unique_lock<std::mutex> ul(_connsLck);
+            port_free_nolock(conport);
+            _connsCnt--;
             _conns_close_event.notifyAll();
         }
     }
 }
 
+/*
+ returns NULL once RX_BUFFER_MAX buffers are handed out
+ */
+unsigned char *USBDevice::rx_buffer_get() noexcept{
+    unsigned char *ret = NULL;
+    std::unique_lock<std::mutex> ul(_rx_bufpoolLck);
+    if (_rx_bufpool.size()) {
+        ret = _rx_bufpool.back();
+        _rx_bufpool.pop_back();
+        return ret;
+    }
+    if (_rx_bufs.size() < RX_BUFFER_MAX && (ret = (unsigned char *)malloc(USB_MRU))) {
+        _rx_bufs.push_back(ret); //never reallocates, capacity is reserved in constructor
+    }
+    return ret;
+}
+
+void USBDevice::rx_buffer_put(unsigned char *buf) noexcept{
+    if (!buf) return;
+    std::unique_lock<std::mutex> ul(_rx_bufpoolLck);
+    _rx_bufpool.push_back(buf); //never reallocates, capacity is reserved in constructor
+}
+
+/*
+ gives back the buffer of a parsed packet, or resubmits the transfer it still belongs to
+ */
+void USBDevice::rx_packet_release(rx_packet &pkt) noexcept{
+    if (pkt.xfer) {
+        /*
+            Always re-submit transfer and let USBDeviceManager properly delete it in case something went wrong
+         */
+        ((rx_xfer_ctx*)pkt.xfer->user_data)->submitted = std::chrono::steady_clock::now();
+        libusb_submit_transfer(pkt.xfer);
+    } else {
+        rx_buffer_put(pkt.buf);
+    }
+    pkt = {};
+}
+
+/*
+ returns NULL if no connection was ever published on the page of port
+ */
+USBDevice::conn_slot *USBDevice::conn_slot_get(uint16_t port) noexcept{
+    conn_slot *page = _connPages[port / CONN_TABLE_PAGE_SIZE];
+    if (!page) return NULL;
+    return &page[port % CONN_TABLE_PAGE_SIZE];
+}
+
+/*
+ Returns the first free port at or after _nextPort, so recently closed ports aren't reused right away.
+ _portWordsFull marks bitmap words without a free port, which keeps the search bounded.
+ */
+uint16_t USBDevice::port_alloc_nolock(){
+    uint32_t word = _nextPort / 64;
+    uint64_t freebits = ~_portBits[word] & (~0ULL << (_nextPort % 64));
+    uint32_t port = 0;
+
+    if (!freebits) {
+        int fullWord = -1;
+        uint32_t start = (word+1) % PORT_BITMAP_WORDS;
+        for (uint32_t i=0; i<=PORT_BITMAP_WORDS/64; i++) {
+            uint32_t sw = (start/64 + i) % (PORT_BITMAP_WORDS/64);
+            uint64_t nonfull = ~_portWordsFull[sw];
+            if (i == 0) nonfull &= ~0ULL << (start % 64);
+            else if (i == PORT_BITMAP_WORDS/64) nonfull &= ~(~0ULL << (start % 64));
+            if (nonfull) {
+                fullWord = sw*64 + __builtin_ctzll(nonfull);
+                break;
+            }
+        }
+        retassure(fullWord != -1, "Failed to find available port!");
+        word = fullWord;
+        freebits = ~_portBits[word];
+    }
+    port = word*64 + __builtin_ctzll(freebits);
+
+    _portBits[word] |= 1ULL << (port % 64);
+    if (_portBits[word] == ~0ULL) _portWordsFull[word/64] |= 1ULL << (word % 64);
+    _nextPort = (uint16_t)(port+1);
+    return (uint16_t)port;
+}
+
+void USBDevice::port_free_nolock(uint16_t port) noexcept{
+    uint32_t word = port / 64;
+    _portBits[word] &= ~(1ULL << (port % 64));
+    _portWordsFull[word/64] &= ~(1ULL << (word % 64));
+}
+
 #pragma mark inheritence provider
 void USBDevice::kill() noexcept{
     debug("[Killing] USBDevice %s",_serial);
@@ -153,6 +553,16 @@ void USBDevice::deconstruct() noexcept{
     debug("[Deconstructing] USBDevice %s",_serial);
     std::shared_ptr<USBDevice> selfref = _selfref.lock();
     _mux->delete_device(selfref);
+    //stop coalescing, packets which weren't flushed yet are dropped with the device
+    tx_flush_stop();
+    //give back stashed packets, transfers held by them need to be in flight to get cancelled below
+    {
+        std::unique_lock<std::mutex> ul(_rxLck);
+        _rx_stashStop = true;
+        for (auto &slot : _rx_stash) {
+            rx_packet_release(slot.pkt);
+        }
+    }
     //cancel all rx transfers
     {
         guardRead(_rx_xfers_Guard);
@@ -162,61 +572,70 @@ void USBDevice::deconstruct() noexcept{
         }
     }
 
-    //cancel all tx transfers
+    //cancel all tx transfers, descriptors in _tx_free were never submitted or completed already
     {
-        guardRead(_tx_xfers_Guard);
-        for (auto xfer : _tx_xfers) {
-            debug("cancelling _tx_xfers(%p)",xfer);
-            libusb_cancel_transfer(xfer);
+        std::unique_lock<std::mutex> ul(_tx_ringLck);
+        if (_tx_inflight) {
+            std::set<struct libusb_transfer *> idle(_tx_free.begin(), _tx_free.end());
+            for (auto xfer : _tx_ring) {
+                if (idle.find(xfer) == idle.end()) libusb_cancel_transfer(xfer);
+            }
         }
     }
     
     //cancel all TCP connections
     {
-        {
-            guardRead(_conns_Guard);
-            for (auto c : _conns) {
-                _reapConnections.post(c.first);
+        std::unique_lock<std::mutex> ul(_connsLck);
+        for (uint32_t port = 0; port < 0x10000; port++) {
+            conn_slot *slot = conn_slot_get((uint16_t)port);
+            if (!slot) {
+                port += CONN_TABLE_PAGE_SIZE-1; //skip unallocated page
+                continue;
             }
+            if (slot->owner) _reapConnections.post((uint16_t)port);
         }
-        while (true) {
-            uint64_t wevent = 0;
-            {
-                guardRead(_conns_Guard);
-                if (_conns.size() == 0) break;
-                wevent = _conns_close_event.getNextEvent();
-            }
+        while (_connsCnt) {
+            uint64_t wevent = _conns_close_event.getNextEvent();
+            ul.unlock();
             _conns_close_event.waitForEvent(wevent);
+            ul.lock();
         }
     }
 }
 
 void USBDevice::start_connect(uint16_t dport, std::shared_ptr<Client> cli){
     std::shared_ptr<TCP> conn;
-    assure(_conns.size() < 0xfff0); //we can't handle more connections than we have ports!
+    TCPManager *tcpmgr = NULL;
+    retassure(tcpmgr = _mux->getTCPManager(), "No TCPManager running!");
 
     {
-        guardWrite(_conns_Guard);
-        bool didIterAllPorts = false;
-        while (_conns.find(_nextPort) != _conns.end() || _nextPort == 0){
-            if (_nextPort == 0) {
-                retassure(!didIterAllPorts, "Failed to find available port!");
-                didIterAllPorts = true;
-            }
-            _nextPort++;
-        }
+        std::unique_lock<std::mutex> ul(_connsLck);
+        conn_slot *slot = NULL;
+        uint16_t port = 0;
+        assure(_connsCnt < 0xfff0); //we can't handle more connections than we have ports!
+        port = port_alloc_nolock();
         try {
-            conn = std::make_shared<TCP>(_nextPort,dport,_selfref.lock(),cli);
+            if (!(slot = conn_slot_get(port))) {
+                conn_slot *page = new conn_slot[CONN_TABLE_PAGE_SIZE]{};
+                _connPages[port / CONN_TABLE_PAGE_SIZE] = page;
+                slot = &page[port % CONN_TABLE_PAGE_SIZE];
+            }
+            conn = std::make_shared<TCP>(port,dport,_selfref.lock(),cli,tcpmgr);
+            conn->_selfref = conn;
         } catch (...) {
+            port_free_nolock(port);
             throw;
         }
-        _conns[_nextPort] = conn;
+        slot->owner = conn;
+        slot->conn = conn.get(); //publish to RX
+        _connsCnt++;
     }
 
     try {
         conn->connect();
     } catch (tihmstar::exception &e) {
         error("failed to connect client dport=%d error=%s code=%d",dport,e.what(),e.code());
+        closeConnection(conn->_sPort);
         throw;
     }
 }
@@ -249,32 +668,94 @@ void USBDevice::mux_init(){
     send_packet(MUX_PROTO_VERSION, &vh, sizeof(vh));
 }
 
+size_t USBDevice::mux_header_size() const noexcept{
+    return (_muxdev.version < 2) ? sizeof(struct mux_header_v1) : sizeof(struct mux_header_v2);
+}
+
+unsigned char *USBDevice::tx_buffer_get(){
+    unsigned char *ret = NULL;
+    {
+        std::unique_lock<std::mutex> ul(_tx_bufpoolLck);
+        if (_tx_bufpool.size()) {
+            ret = _tx_bufpool.back();
+            _tx_bufpool.pop_back();
+            return ret;
+        }
+    }
+    retassure(ret = (unsigned char *)malloc(USB_MTU), "Failed to alloc TX buffer for device %s", _serial);
+    return ret;
+}
+
+void USBDevice::tx_buffer_put(unsigned char *buf) noexcept{
+    if (!buf) return;
+    {
+        std::unique_lock<std::mutex> ul(_tx_bufpoolLck);
+        if (_tx_bufpool.size() < TX_BUFFER_POOL_SIZE) {
+            _tx_bufpool.push_back(buf); //never reallocates, capacity is reserved in constructor
+            return;
+        }
+    }
+    free(buf);
+}
+
 void USBDevice::send_packet(enum mux_protocol proto, const void *data, size_t length, tcphdr *header){
-    /*
-     buf allocated and guaranteed transfered to usb_send without failing in between.
-     usb_send will always make sure buf is freed, even in case of failure.
-     Don't free buf in this function in any case!
-     */
-    unsigned char *buf = NULL; //unchecked
+    unsigned char *buf = NULL;
+    cleanup([&]{
+        tx_buffer_put(buf);
+    });
+    size_t payloadOffset = 0;
+
+    payloadOffset = mux_header_size();
+    if (header) {
+        payloadOffset += sizeof(tcphdr);
+    }
+
+    retassure(payloadOffset + length <= USB_MTU, "Tried to send packet larger than USB MTU (hdr %zu data %zu total %zu) to device %s", payloadOffset, length, payloadOffset + length, _serial);
+
+    buf = tx_buffer_get();
+    if (length) {
+        memcpy(buf + payloadOffset, data, length);
+    }
+    {
+        unsigned char *sendbuf = buf; buf = NULL; //consumed by send_packet_inplace in any case
+        send_packet_inplace(proto, sendbuf, length, header);
+    }
+}
+
+/*
+ buf needs to come from tx_buffer_get() and is consumed in any case, even on failure.
+ The caller places the payload at buf + mux_header_size() (+ sizeof(tcphdr) if header is set),
+ this function fills in the headers in front of it and submits the buffer as is.
+ Data senders pass reserved after a successful tx_reserve(), the reservation is consumed in any case as well.
+ Packets without a reservation never wait for the bus and may use the spill descriptors.
+ */
+void USBDevice::send_packet_inplace(enum mux_protocol proto, unsigned char *buf, size_t length, tcphdr *header, bool reserved){
+    size_t credit = reserved ? TX_DATA_RESERVE : 0;
+    cleanup([&]{
+        tx_buffer_put(buf);
+        tx_unreserve(credit);
+    });
     size_t buflen = 0;
     mux_header *mhdr = NULL; //unchecked
-    int mux_header_size = 0;
+    size_t hdrsize = 0;
 
-    mux_header_size = ((_muxdev.version < 2) ? sizeof(struct mux_header_v1) : sizeof(struct mux_header_v2));
+    hdrsize = mux_header_size();
 
-    buflen = mux_header_size + length;
+    buflen = hdrsize + length;
     if (header) {
         buflen += sizeof(tcphdr);
     }
 
     assure(buflen>length); //sanity check
 
-    retassure(buflen <= USB_MTU, "Tried to send packet larger than USB MTU (hdr %zu data %zu total %zu) to device %s", buflen, length, buflen, _serial);
+    retassure(buflen <= USB_MTU, "Tried to send packet larger than USB MTU (hdr %zu data %zu total %zu) to device %s", buflen-length, length, buflen, _serial);
 
-    buf = (unsigned char *)malloc(buflen); //unchecked
     mhdr = (mux_header *)buf;
     mhdr->protocol = htonl(proto);
     mhdr->length = htonl(buflen);
+    if (header) {
+        memcpy(buf + hdrsize, header, sizeof(tcphdr));
+    }
 
     {
         std::unique_lock<std::mutex> ul(_usbLck);
@@ -289,16 +770,14 @@ void USBDevice::send_packet(enum mux_protocol proto, const void *data, size_t le
 //            debug("----- MUX UPDATE SEND _muxdev.tx_seq=%d _muxdev.rx_seq=%d",_muxdev.tx_seq,_muxdev.rx_seq);
             _muxdev.tx_seq++;
         }
-        if (header) {
-            memcpy(buf + mux_header_size, header, sizeof(tcphdr));
-            memcpy(buf + mux_header_size + sizeof(tcphdr), data, length);
-        }else{
-            memcpy(buf + mux_header_size, data, length);
-        }
 
+        _tx_credit = credit; credit = 0;
+        cleanup([&]{
+            credit = _tx_credit; _tx_credit = 0; //unused part, given back once _usbLck is released
+        });
         try {
-            unsigned char *sendbuf = buf; buf = NULL; //freed by usb_send in any case
-            usb_send(sendbuf, buflen);
+            unsigned char *sendbuf = buf; buf = NULL; //consumed by tx_enqueue_nolock in any case
+            tx_enqueue_nolock(sendbuf, buflen);
         } catch (tihmstar::exception &e) {
             debug("failed to send packet to usbdevice(%p) error=%s code=%d",this,e.what(),e.code());
             kill();
@@ -308,70 +787,47 @@ void USBDevice::send_packet(enum mux_protocol proto, const void *data, size_t le
 }
 
 /*
- always frees buf
+ always consumes buf (which needs to come from tx_buffer_get())
  */
-void USBDevice::usb_send(void *buf, size_t length){
-    struct libusb_transfer *xfer = NULL;
-    std::shared_ptr<USBDevice> *txcbargref = nullptr;
+void USBDevice::usb_send(unsigned char *buf, size_t length){
+    static unsigned char zlpbuf[1] = {};
     cleanup([&]{
-        safeDelete(txcbargref);
-        safeFree(buf);
-        if (xfer) {
-            {
-                guardWrite(_tx_xfers_Guard);
-                _tx_xfers.erase(xfer);
-            }
-            safeFree(xfer->buffer);
-            {
-                std::shared_ptr<USBDevice> *userdata = (std::shared_ptr<USBDevice> *)xfer->user_data; xfer->user_data = NULL;
-                safeDelete(userdata);
-            }
-            libusb_free_transfer(xfer);
-        }
+        tx_buffer_put(buf);
     });
-    int ret = 0;
 
     assure(length<=INT_MAX); //sanity check
-    assure(xfer = libusb_alloc_transfer(0));
-    xfer->user_data = NULL;
-
-    txcbargref = new std::shared_ptr<USBDevice>(_selfref.lock());
-    libusb_fill_bulk_transfer(xfer, _usbdev, _ep_out, (unsigned char *)buf, (int)length, tx_callback, txcbargref, 0);
-    buf = NULL;
-    txcbargref = nullptr;
-
-    {
-        guardWrite(_tx_xfers_Guard);
-        _tx_xfers.insert(xfer);
-    }
-    retassure((ret = libusb_submit_transfer(xfer)) >=0, "Failed to submit TX transfer %p len %zu to device %d-%d: %d", buf, length, _bus, _address, ret);
-    xfer = NULL;
+    tx_xfer_submit(buf, length);
+    buf = NULL; //owned by xfer now
     if (length % _wMaxPacketSize == 0 && length >= _wMaxPacketSize) {
         debug("Send ZLP");
         // Send Zero Length Packet
-        assure(buf = malloc(1));
-        assure(xfer = libusb_alloc_transfer(0));
-        xfer->user_data = NULL;
-
-        txcbargref = new std::shared_ptr<USBDevice>(_selfref.lock());
-        libusb_fill_bulk_transfer(xfer, _usbdev, _ep_out, (unsigned char *)buf, 0, tx_callback, txcbargref, 0);
-        buf = NULL;
-        txcbargref = nullptr;
-
-        {
-            guardWrite(_tx_xfers_Guard);
-            _tx_xfers.insert(xfer);
-        }
-        retassure((ret = libusb_submit_transfer(xfer)) >=0, "Failed to submit TX ZLP transfer to device %d-%d: %d", _bus, _address, ret);
-        xfer = NULL;
+        tx_xfer_submit(zlpbuf, 0);
     }
 }
 
-void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
+/*
+ mux v2 packets are handed to device_packet_input strictly in tx_seq order by a single thread at a time.
+ Whoever receives the next expected packet drains it and everything which got stashed behind it,
+ out of order packets and packets arriving while someone else drains are parked in _rx_stash.
+ No RX thread ever waits. A stashed packet keeps its RX buffer (and its transfer, if it still has one),
+ so a slow drainer runs the device out of RX buffers and transfers wait instead of being resubmitted.
+ Takes over pkt if it was stashed, otherwise the caller still needs to release it.
+ */
+void USBDevice::device_data_input(rx_packet &pkt){
     mux_header *mhdr = NULL;
-    unsigned char *payload = NULL;
-    uint32_t payload_length = 0;
-    int mux_header_size = 0;
+    unsigned char *buffer = pkt.buf;
+    uint32_t length = pkt.len;
+    rx_packet held = {}; //stashed packet we're currently draining
+    cleanup([&]{
+        rx_packet_release(held);
+    });
+    bool isDrainer = false;
+    cleanup([&]{
+        if (isDrainer) {
+            std::unique_lock<std::mutex> ul(_rxLck);
+            _rx_draining = false;
+        }
+    });
 
     if(!length)
         return;
@@ -379,66 +835,115 @@ void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
     // sanity check (should never happen with current USB implementation)
     retassure((length <= USB_MRU) && (length <= DEV_MRU),"Too much data received from USB (%u), file a bug", length);
 
-//    debug("Mux data input for device %s: len %u", _serial, length);
     mhdr = (mux_header *)buffer;
-
-    {
-        std::unique_lock<std::mutex> ul(_usbLck);
-        mux_header_size = ((_muxdev.version < 2) ? sizeof(struct mux_header_v1) : sizeof(struct mux_header_v2));
 #ifdef XCODE
-        assert(ntohl(mhdr->length) <= USB_MRU);
+    assert(ntohl(mhdr->length) <= USB_MRU);
 #endif
-        retassure(ntohl(mhdr->length) == length, "Incoming packet size mismatch (dev %s, expected %d, got %u)", _serial, ntohl(mhdr->length), length);
-        if (_muxdev.version >= 2) {
-            cleanup([&]{
-                _data_in_event.notifyAll();
-            });
-            uint16_t txseq = ntohs(mhdr->v2.tx_seq);
-//            debug("----- MUX txseq=%d -- _muxdev.tx_seq=%d _muxdev.rx_seq=%d",txseq,_muxdev.tx_seq,_muxdev.rx_seq);
-            if ((uint16_t)(_muxdev.rx_seq+1) != txseq) {
-                while ((uint16_t)(_muxdev.rx_seq+1) < txseq || (uint16_t)(_muxdev.rx_seq+1+_rx_xfers.size()) < txseq + _rx_xfers.size()) {
-                    uint64_t wevent = _data_in_event.getNextEvent();
-                    ul.unlock();
-                    _data_in_event.waitForEvent(wevent);
-                    ul.lock();
-                }
-            }
-            if ((uint16_t)(_muxdev.rx_seq+1) != txseq){
-                debug("Discarding duplicated MUX packet txseq=%d -- _muxdev.tx_seq=%d _muxdev.rx_seq=%d",txseq,_muxdev.tx_seq,_muxdev.rx_seq);
-                return;
-            }
-            _muxdev.rx_seq = txseq;
-        }
-        
-        // handle broken up transfers
-        if(_muxdev.pktlen) {
-            if (_muxdev.version < 2){
-                error("Mux v1 doesn't support broken up transfers!");
-                reterror("Mux v1 doesn't support broken up transfers!");
-            }
+    retassure(ntohl(mhdr->length) == length, "Incoming packet size mismatch (dev %s, expected %d, got %u)", _serial, ntohl(mhdr->length), length);
 
-            //check rx/tx
-            retassure((length + _muxdev.pktlen) <= DEV_MRU, "Incoming split packet is too large (%u so far), dropping!", length + _muxdev.pktlen);
+    if (_muxdev.version < 2) {
+        //no sequence numbers and no split packets, nothing to put in order
+        return device_packet_input(buffer, length);
+    }
 
-            memcpy(_muxdev.pktbuf + _muxdev.pktlen, buffer, length);
+    {
+        std::unique_lock<std::mutex> ul(_rxLck);
+        uint16_t txseq = ntohs(mhdr->v2.tx_seq);
+        uint16_t ahead = txseq - (uint16_t)(_muxdev.rx_seq+1);
+//        debug("----- MUX txseq=%d -- _muxdev.tx_seq=%d _muxdev.rx_seq=%d",txseq,_muxdev.tx_seq,_muxdev.rx_seq.load());
+        if (_rx_stashStop) return;
+        if (ahead >= 0x8000){
+            debug("Discarding duplicated MUX packet txseq=%d -- _muxdev.tx_seq=%d _muxdev.rx_seq=%d",txseq,_muxdev.tx_seq,_muxdev.rx_seq.load());
+            return;
+        }
+        if (ahead || _rx_draining) {
+            rx_stash_nolock(txseq, pkt);
+            return;
+        }
+        _muxdev.rx_seq = txseq;
+        _rx_draining = isDrainer = true;
+    }
 
-            if((length < USB_MRU) || (ntohl(mhdr->length) == (length + _muxdev.pktlen))) {
-                buffer = _muxdev.pktbuf;
-                length += _muxdev.pktlen;
-                _muxdev.pktlen = 0;
-                debug("Gathered mux data from buffer (total size: %u)", length);
-            } else {
-                _muxdev.pktlen += (uint32_t)length;
-                debug("Appended mux data to buffer (total size: %u)", _muxdev.pktlen);
-                return;
-            }
-        }else{
-            if((length == USB_MRU) && (length < ntohl(mhdr->length))) {
-                memcpy(_muxdev.pktbuf, buffer, length);
-                _muxdev.pktlen = (uint32_t)length;
-                debug("Copied mux data to buffer (size: %u)", _muxdev.pktlen);
-                return;
+    while (true) {
+        device_packet_input(buffer, length);
+        rx_packet_release(held);
+        {
+            std::unique_lock<std::mutex> ul(_rxLck);
+            uint16_t next = _muxdev.rx_seq+1;
+            rx_stash_slot *slot = &_rx_stash[next % RX_REORDER_RING_SIZE];
+            if (!slot->pkt.buf || slot->seq != next) {
+                _rx_draining = isDrainer = false; //must happen together with the check, or a stashed packet could get stuck
+                break;
             }
+            //detach packet, the slot may be refilled while we process it
+            held = slot->pkt;
+            slot->pkt = {};
+            buffer = held.buf;
+            length = held.len;
+            _muxdev.rx_seq = next;
+        }
+    }
+}
+
+/*
+ Every stashed packet holds one of at most RX_BUFFER_MAX RX buffers, so the ring can't fill up
+ while the device keeps its sequence numbers contiguous.
+ */
+void USBDevice::rx_stash_nolock(uint16_t seq, rx_packet &pkt){
+    uint16_t ahead = seq - (uint16_t)(_muxdev.rx_seq+1);
+    rx_stash_slot *slot = &_rx_stash[seq % RX_REORDER_RING_SIZE];
+    retassure(ahead < RX_REORDER_RING_SIZE, "MUX packet txseq=%d skipped sequence numbers after rx_seq=%d",seq,_muxdev.rx_seq.load());
+    if (slot->pkt.buf) {
+        retassure(slot->seq == seq, "RX reorder slot for txseq=%d is occupied by txseq=%d",seq,slot->seq);
+        debug("Discarding duplicated MUX packet txseq=%d",seq);
+        return;
+    }
+    slot->pkt = pkt;
+    slot->seq = seq;
+    pkt = {};
+}
+
+/*
+ For mux v2 this is called with packets in order and never concurrently.
+ */
+void USBDevice::device_packet_input(unsigned char *buffer, uint32_t length){
+    mux_header *mhdr = (mux_header *)buffer;
+    unsigned char *payload = NULL;
+    uint32_t payload_length = 0;
+    int mux_header_size = 0;
+
+    mux_header_size = ((_muxdev.version < 2) ? sizeof(struct mux_header_v1) : sizeof(struct mux_header_v2));
+
+    // handle broken up transfers
+    if(_muxdev.pktlen) {
+        if (_muxdev.version < 2){
+            error("Mux v1 doesn't support broken up transfers!");
+            reterror("Mux v1 doesn't support broken up transfers!");
+        }
+
+        //check rx/tx
+        retassure((length + _muxdev.pktlen) <= DEV_MRU, "Incoming split packet is too large (%u so far), dropping!", length + _muxdev.pktlen);
+
+        memcpy(_muxdev.pktbuf + _muxdev.pktlen, buffer, length);
+
+        if((length < USB_MRU) || (ntohl(mhdr->length) == (length + _muxdev.pktlen))) {
+            buffer = _muxdev.pktbuf;
+            length += _muxdev.pktlen;
+            _muxdev.pktlen = 0;
+            mhdr = (mux_header *)buffer;
+            debug("Gathered mux data from buffer (total size: %u)", length);
+        } else {
+            _muxdev.pktlen += (uint32_t)length;
+            debug("Appended mux data to buffer (total size: %u)", _muxdev.pktlen);
+            return;
+        }
+    }else{
+        if((length == USB_MRU) && (length < ntohl(mhdr->length))) {
+            retassure(_muxdev.version >= 2, "Mux v1 doesn't support broken up transfers!");
+            memcpy(_muxdev.pktbuf, buffer, length);
+            _muxdev.pktlen = (uint32_t)length;
+            debug("Copied mux data to buffer (size: %u)", _muxdev.pktlen);
+            return;
         }
     }
 
@@ -464,14 +969,15 @@ void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
             payload = reinterpret_cast<std::uint8_t*>(tcp_header+1);
             payload_length = length - sizeof(tcphdr) - mux_header_size;
             uint16_t dport = htons(tcp_header->th_dport);
-            std::shared_ptr<TCP> connect = nullptr;
-            {
-                guardRead(_conns_Guard);
-                auto conn = _conns.find(dport);
-                if (conn != _conns.end()){
-                    connect = conn->second;
-                }
+            conn_slot *slot = conn_slot_get(dport);
+            TCP *connect = NULL;
+            if (slot) {
+                slot->readers++; //pins the connection until we leave the slot
+                if (!(connect = slot->conn)) slot->readers--;
             }
+            cleanup([&]{
+                if (connect) slot->readers--;
+            });
             if (!connect){
                 try {
                     TCP::send_RST(this, tcp_header);
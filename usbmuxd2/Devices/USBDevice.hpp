@@ -16,10 +16,28 @@
 #include <libgeneral/DeliveryEvent.hpp>
 #include <set>
 #include <map>
+#include <vector>
+#include <chrono>
+#include <condition_variable>
+#include <atomic>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
 #define DEV_MRU 65535
+#define TX_BUFFER_POOL_SIZE 32
+#define TX_XFER_RING_SIZE 32
+#define TX_XFER_SPILL_MAX 8             //extra TX descriptors for packets which can't wait for the ring, like ACKs and window updates
+#define TX_DATA_RESERVE 2               //TX descriptors a data packet may need, one for the pending batch and one for itself
+#define TX_COALESCE_MAX_PACKET 0x1000   //larger packets are submitted as they are
+#define TX_COALESCE_DEADLINE_US 100
+#define RX_DEPTH_MAX 16                 //hard upper bound for RX transfers in flight per device
+#define RX_BUFFER_MAX (2*RX_DEPTH_MAX)  //filled RX buffers waiting for the parser, beyond that transfers wait for the parser
+#define RX_ADAPT_INTERVAL_MS 250        //RX depth is reevaluated at most once per interval
+#define RX_ADAPT_GAIN_PERCENT 10        //an additional RX transfer is kept only if it raised throughput at least this much
+#define CONN_TABLE_PAGE_SIZE 0x100
+#define CONN_TABLE_PAGES (0x10000/CONN_TABLE_PAGE_SIZE)
+#define PORT_BITMAP_WORDS (0x10000/64)
+#define RX_REORDER_RING_SIZE 64         //must exceed RX_BUFFER_MAX, stashed packets keep their RX buffer
 
 class TCP;
 class USBDeviceManager;
@@ -62,7 +80,27 @@ public:
         uint8_t *pktbuf;
         uint32_t pktlen;
         uint16_t tx_seq;
-        uint16_t rx_seq;
+        std::atomic<uint16_t> rx_seq;   //written by RX, read by TX
+    };
+    struct rx_packet{
+        unsigned char *buf;
+        uint32_t len;
+        struct libusb_transfer *xfer;   //if set, buf still belongs to xfer, which needs to be resubmitted once buf was processed
+    };
+    struct rx_xfer_ctx{                 //user_data of RX transfers
+        std::shared_ptr<USBDevice> dev;
+        std::chrono::steady_clock::time_point submitted;
+    };
+    struct rx_stash_slot{
+        rx_packet pkt;                  //pkt.buf is NULL if slot is empty
+        uint16_t seq;
+    };
+    struct speed_profile{
+        uint64_t minSpeed;              //profile applies to devices at least this fast
+        unsigned rxDepthMin;
+        unsigned rxDepthMax;
+        unsigned txInflightMax;
+        size_t txBatchMax;
     };
     enum mux_protocol {
         MUX_PROTO_VERSION = 0,
@@ -87,19 +125,67 @@ private:
     mux_dev_state _state;
     mux_device _muxdev;
     std::mutex _usbLck;
-    tihmstar::Event _data_in_event;
+
+    std::mutex _rxLck;
+    rx_stash_slot _rx_stash[RX_REORDER_RING_SIZE];    //out of order packets, guarded by _rxLck
+    bool _rx_draining;                                //guarded by _rxLck
+    bool _rx_stashStop;                               //device is going away, guarded by _rxLck
 
     std::set<USBDevice_receiver*> _receivers;
     
     std::set<struct libusb_transfer *> _rx_xfers;
     tihmstar::GuardAccess _rx_xfers_Guard;
-    std::set<struct libusb_transfer *> _tx_xfers;
-    tihmstar::GuardAccess _tx_xfers_Guard;
-    std::map<uint16_t,std::shared_ptr<TCP>> _conns;
-    tihmstar::GuardAccess _conns_Guard;
+    unsigned _rx_depthMin, _rx_depthMax;
+    struct{                                           //only touched by the libusb event thread
+        std::chrono::steady_clock::time_point start;
+        uint64_t bytes;
+        uint32_t cnt;
+        uint32_t large;
+        uint32_t stalled;
+        std::chrono::steady_clock::duration latency;
+        uint64_t probeRate;                           //throughput before the last RX transfer was added, 0 if not probing
+        unsigned cap;                                 //depth which did not pay off during the current bulk transfer
+    } _rx_stat;
+    std::vector<unsigned char *> _rx_bufs;            //all RX buffers, owned
+    std::vector<unsigned char *> _rx_bufpool;         //idle RX buffers
+    std::mutex _rx_bufpoolLck;
+    std::vector<struct libusb_transfer *> _tx_ring;   //all TX descriptors including the spill ones, owned
+    std::vector<struct libusb_transfer *> _tx_free;   //TX descriptors which aren't submitted
+    size_t _tx_inflight;
+    size_t _tx_inflightMax;
+    size_t _tx_reserved;                              //descriptors promised to data senders by tx_reserve, guarded by _tx_ringLck
+    bool _tx_stopping;                                //no more submissions, guarded by _tx_ringLck
+    std::shared_ptr<USBDevice> _tx_pin;               //keeps us alive while TX transfers are in flight
+    std::mutex _tx_ringLck;
+    tihmstar::Event _tx_ringEvent;
+    std::vector<unsigned char *> _tx_bufpool;
+    std::mutex _tx_bufpoolLck;
+
+    size_t _tx_credit;                                //reserved descriptors of the current sender, guarded by _usbLck
+    unsigned char *_tx_batch;                         //guarded by _usbLck
+    size_t _tx_batchLen;
+    size_t _tx_batchMax;
+    std::chrono::steady_clock::time_point _tx_batchDeadline;
+    bool _tx_batchStop;
+    std::condition_variable _tx_batchCond;
+    std::thread _txFlushThread;
+    /*
+        Connections are published in a flat table indexed by source port. Its pages are allocated on first use.
+        RX looks up slots without locking, the reaper waits for readers to leave a slot before releasing its connection.
+     */
+    struct conn_slot{
+        std::atomic<TCP*> conn;
+        std::atomic<uint32_t> readers;
+        std::shared_ptr<TCP> owner;                   //guarded by _connsLck
+    };
+    std::atomic<conn_slot*> _connPages[CONN_TABLE_PAGES];
+    uint64_t _portBits[PORT_BITMAP_WORDS];            //guarded by _connsLck
+    uint64_t _portWordsFull[PORT_BITMAP_WORDS/64];    //guarded by _connsLck
+    size_t _connsCnt;                                 //guarded by _connsLck
+    std::mutex _connsLck;
     tihmstar::Event _conns_close_event;
 
-    tihmstar::DeliveryEvent<struct libusb_transfer *> _arrived_xfer;
+    tihmstar::DeliveryEvent<rx_packet> _arrived_xfer;
 
     std::thread _conReaperThread;
     tihmstar::DeliveryEvent<uint16_t> _reapConnections;
@@ -107,7 +193,21 @@ private:
 private:
     bool isDeviceReadyForDestruction();
     void addReceiver();
+    void apply_speed_profile() noexcept;
+    int rx_adapt(uint32_t length, std::chrono::steady_clock::duration latency, bool parserBehind) noexcept;
     void reaper_runloop();
+    unsigned char *rx_buffer_get() noexcept;
+    void rx_buffer_put(unsigned char *buf) noexcept;
+    void rx_packet_release(rx_packet &pkt) noexcept;
+    conn_slot *conn_slot_get(uint16_t port) noexcept;
+    uint16_t port_alloc_nolock();
+    void port_free_nolock(uint16_t port) noexcept;
+    void tx_xfer_submit(unsigned char *buf, size_t length);
+    void tx_xfer_put(struct libusb_transfer *xfer) noexcept;
+    void tx_enqueue_nolock(unsigned char *buf, size_t length);
+    void tx_batch_flush_nolock();
+    void tx_flush_runloop();
+    void tx_flush_stop() noexcept;
 
 public:
     USBDevice(Muxer *mux, USBDeviceManager *parent, uint16_t pid);
@@ -125,10 +225,18 @@ public:
     uint16_t getPid();
     
     void mux_init();
+    size_t mux_header_size() const noexcept;
+    unsigned char *tx_buffer_get();
+    void tx_buffer_put(unsigned char *buf) noexcept;
     void send_packet(enum mux_protocol proto, const void *data, size_t length, tcphdr *header = NULL);
-    void usb_send(void *buf, size_t length);
+    void send_packet_inplace(enum mux_protocol proto, unsigned char *buf, size_t length, tcphdr *header = NULL, bool reserved = false);
+    bool tx_reserve(size_t cnt = TX_DATA_RESERVE) noexcept;
+    void tx_unreserve(size_t cnt) noexcept;
+    void usb_send(unsigned char *buf, size_t length);
     
-    void device_data_input(unsigned char *buffer, uint32_t length);
+    void device_data_input(rx_packet &pkt);
+    void device_packet_input(unsigned char *buffer, uint32_t length);
+    void rx_stash_nolock(uint16_t seq, rx_packet &pkt);
     void device_version_input(struct mux_version_header *vh);
     void device_control_input(unsigned char *payload, uint32_t payload_length);
     
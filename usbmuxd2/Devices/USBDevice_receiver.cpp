@@ -20,15 +20,12 @@ USBDevice_receiver::~USBDevice_receiver(){
 }
 
 bool USBDevice_receiver::loopEvent(){
-    struct libusb_transfer *xfer = _parent->_arrived_xfer.wait();
+    USBDevice::rx_packet pkt = _parent->_arrived_xfer.wait();
     cleanup([&]{
-        /*
-            Always re-submit transfer and let USBDeviceManager properly delete it in case something went wrong
-         */
-        libusb_submit_transfer(xfer);
+        _parent->rx_packet_release(pkt); //no-op if the packet was stashed
     });
     try {
-        _parent->device_data_input(xfer->buffer, xfer->actual_length);
+        _parent->device_data_input(pkt);
         return true;
     } catch (tihmstar::exception &e) {
         error("failed to device_data_input usbdev=%s error=%s code=%d",_parent->_serial,e.what(),e.code());
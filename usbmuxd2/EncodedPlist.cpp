@@ -0,0 +1,58 @@
+//
+//  EncodedPlist.cpp
+//  usbmuxd2
+//
+
+#include "EncodedPlist.hpp"
+#include "usbmuxd2-proto.h"
+#include <libgeneral/macros.h>
+#include <stdlib.h>
+
+#pragma mark EncodedPlist
+EncodedPlist::EncodedPlist(plist_t plist, uint32_t tag)
+: _plist(plist), _tag(tag), _xml(NULL), _xmlsize(0), _encoded{}
+{
+    //
+}
+
+EncodedPlist::~EncodedPlist(){
+    safeFreeCustom(_plist, plist_free);
+    safeFree(_xml);
+}
+
+EncodedPlist::packet EncodedPlist::get(uint32_t version){
+    std::unique_lock<std::mutex> ul(_lck);
+    uint32_t slot = version ? 1 : 0;
+    if (!_encoded[slot]) {
+        std::string pkt;
+        struct usbmuxd_header hdr{};
+        if (!_xml) {
+            retassure(_plist, "EncodedPlist has nothing to encode");
+            plist_to_xml(_plist, &_xml, &_xmlsize);
+            retassure(_xml, "Failed to convert plist to xml");
+            safeFreeCustom(_plist, plist_free); //not needed anymore
+        }
+        hdr.length = (uint32_t)(sizeof(hdr) + _xmlsize);
+        hdr.version = slot;
+        hdr.message = MESSAGE_PLIST;
+        hdr.tag = _tag;
+        pkt.reserve(hdr.length);
+        pkt.append((const char*)&hdr, sizeof(hdr));
+        pkt.append(_xml, _xmlsize);
+        _encoded[slot] = std::make_shared<const std::string>(std::move(pkt));
+        if (_encoded[0] && _encoded[1]) {
+            safeFree(_xml); _xmlsize = 0; //every version is built already
+        }
+    }
+    return _encoded[slot];
+}
+
+EncodedPlist::packet EncodedPlist::get(uint32_t version, uint32_t tag){
+    packet base = get(version);
+    if (tag == _tag) return base;
+    {
+        std::string pkt(*base);
+        ((struct usbmuxd_header*)pkt.data())->tag = tag;
+        return std::make_shared<const std::string>(std::move(pkt));
+    }
+}
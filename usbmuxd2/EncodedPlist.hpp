@@ -0,0 +1,40 @@
+//
+//  EncodedPlist.hpp
+//  usbmuxd2
+//
+
+#ifndef EncodedPlist_hpp
+#define EncodedPlist_hpp
+
+#include <plist/plist.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/*
+ A plist message which is sent to many clients.
+ The plist is converted to XML at most once and the complete packet, including its usbmuxd_header,
+ is built at most once per protocol version. Recipients share the resulting buffer.
+ */
+class EncodedPlist {
+public:
+    typedef std::shared_ptr<const std::string> packet;
+private:
+    plist_t _plist;      //owned, freed once it was converted
+    uint32_t _tag;
+    std::mutex _lck;
+    char *_xml;
+    uint32_t _xmlsize;
+    packet _encoded[2];  //by protocol version, which is either 0 (binary) or 1 (plist)
+
+public:
+    EncodedPlist(plist_t plist, uint32_t tag = 0); //takes ownership of plist
+    EncodedPlist(const EncodedPlist &) = delete;
+    ~EncodedPlist();
+
+    packet get(uint32_t version);
+    packet get(uint32_t version, uint32_t tag); //copy of the encoded packet, answering the request with tag
+};
+
+#endif /* EncodedPlist_hpp */
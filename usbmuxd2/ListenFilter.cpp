@@ -0,0 +1,98 @@
+//
+//  ListenFilter.cpp
+//  usbmuxd2
+//
+
+#include "ListenFilter.hpp"
+#include "Client.hpp"
+#include <libgeneral/macros.h>
+#include <string.h>
+
+#pragma mark ListenFilter
+ListenFilter::ListenFilter(plist_t p_filter)
+: _connTypes(0), _kinds(0)
+{
+    plist_t p_arr = NULL;
+    retassure(plist_get_node_type(p_filter) == PLIST_DICT, "Listen filter is not a dict");
+
+    if ((p_arr = plist_dict_get_item(p_filter, "ConnectionTypes"))) {
+        retassure(plist_get_node_type(p_arr) == PLIST_ARRAY, "ConnectionTypes is not an array");
+        for (uint32_t i=0; i<plist_array_get_size(p_arr); i++) {
+            const char *str = NULL;
+            plist_t p_item = plist_array_get_item(p_arr, i);
+            retassure(plist_get_node_type(p_item) == PLIST_STRING && (str = plist_get_string_ptr(p_item, NULL)), "ConnectionTypes[%u] is not a string", i);
+            if (strcmp(str, "USB") == 0) {
+                _connTypes |= Device::MUXCONN_USB;
+            } else if (strcmp(str, "Network") == 0) {
+                _connTypes |= Device::MUXCONN_WIFI;
+            } else {
+                reterror("Unknown ConnectionType '%s'", str);
+            }
+        }
+    }
+
+    if ((p_arr = plist_dict_get_item(p_filter, "SerialNumbers"))) {
+        retassure(plist_get_node_type(p_arr) == PLIST_ARRAY, "SerialNumbers is not an array");
+        for (uint32_t i=0; i<plist_array_get_size(p_arr); i++) {
+            const char *str = NULL;
+            uint64_t str_len = 0;
+            plist_t p_item = plist_array_get_item(p_arr, i);
+            retassure(plist_get_node_type(p_item) == PLIST_STRING && (str = plist_get_string_ptr(p_item, &str_len)), "SerialNumbers[%u] is not a string", i);
+            _serials.emplace(str, str_len);
+        }
+    }
+
+    if ((p_arr = plist_dict_get_item(p_filter, "ProductIDs"))) {
+        retassure(plist_get_node_type(p_arr) == PLIST_ARRAY, "ProductIDs is not an array");
+        for (uint32_t i=0; i<plist_array_get_size(p_arr); i++) {
+            uint64_t min = 0;
+            uint64_t max = 0;
+            plist_t p_item = plist_array_get_item(p_arr, i);
+            if (plist_get_node_type(p_item) == PLIST_UINT) {
+                plist_get_uint_val(p_item, &min);
+                max = min;
+            } else {
+                plist_t p_min = NULL;
+                plist_t p_max = NULL;
+                retassure(plist_get_node_type(p_item) == PLIST_DICT, "ProductIDs[%u] is neither an integer nor a range", i);
+                retassure((p_min = plist_dict_get_item(p_item, "Min")) && plist_get_node_type(p_min) == PLIST_UINT, "ProductIDs[%u] has no Min", i);
+                retassure((p_max = plist_dict_get_item(p_item, "Max")) && plist_get_node_type(p_max) == PLIST_UINT, "ProductIDs[%u] has no Max", i);
+                plist_get_uint_val(p_min, &min);
+                plist_get_uint_val(p_max, &max);
+            }
+            retassure(min <= max && max <= UINT16_MAX, "ProductIDs[%u] is not a valid range", i);
+            _productIDs.emplace_back((uint16_t)min, (uint16_t)max);
+        }
+    }
+
+    if ((p_arr = plist_dict_get_item(p_filter, "MessageTypes"))) {
+        retassure(plist_get_node_type(p_arr) == PLIST_ARRAY, "MessageTypes is not an array");
+        for (uint32_t i=0; i<plist_array_get_size(p_arr); i++) {
+            const char *str = NULL;
+            plist_t p_item = plist_array_get_item(p_arr, i);
+            retassure(plist_get_node_type(p_item) == PLIST_STRING && (str = plist_get_string_ptr(p_item, NULL)), "MessageTypes[%u] is not a string", i);
+            if (strcmp(str, "Attached") == 0) {
+                _kinds |= 1 << Client::NOTIFY_ATTACHED;
+            } else if (strcmp(str, "Detached") == 0) {
+                _kinds |= 1 << Client::NOTIFY_DETACHED;
+            } else if (strcmp(str, "Paired") == 0) {
+                _kinds |= 1 << Client::NOTIFY_PAIRED;
+            } else {
+                reterror("Unknown MessageType '%s'", str);
+            }
+        }
+    }
+}
+
+bool ListenFilter::matches(const subject &s, int kind) const noexcept{
+    if (_kinds && !(_kinds & (1 << kind))) return false;
+    if (_connTypes && !(_connTypes & s.type)) return false;
+    if (_serials.size() && _serials.find(s.serial) == _serials.end()) return false;
+    if (_productIDs.size()) {
+        for (auto &r : _productIDs) {
+            if (s.productID && r.first <= s.productID && s.productID <= r.second) return true;
+        }
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,47 @@
+//
+//  ListenFilter.hpp
+//  usbmuxd2
+//
+
+#ifndef ListenFilter_hpp
+#define ListenFilter_hpp
+
+#include "Devices/Device.hpp"
+#include <plist/plist.h>
+#include <stdint.h>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ Restricts which notifications a listening client gets.
+ Parsed from the optional "Filter" dict of a Listen request:
+    ConnectionTypes: array of "USB" / "Network"
+    SerialNumbers:   array of strings
+    ProductIDs:      array of integers or {Min, Max} dicts
+    MessageTypes:    array of "Attached" / "Detached" / "Paired"
+ A missing key doesn't restrict anything.
+ */
+class ListenFilter {
+public:
+    struct subject{
+        int deviceID;
+        Device::mux_conn_type type;
+        std::string serial;
+        uint16_t productID;     //0 if the connection has none
+    };
+private:
+    uint32_t _connTypes;        //mask of Device::mux_conn_type, 0 for any
+    uint32_t _kinds;            //mask of 1 << Client::notify_kind, 0 for any
+    std::set<std::string> _serials;
+    std::vector<std::pair<uint16_t, uint16_t>> _productIDs;
+
+public:
+    ListenFilter(plist_t p_filter);
+
+    bool matches(const subject &s, int kind) const noexcept;
+    const std::set<std::string> &serials() const noexcept {return _serials;};
+};
+
+#endif /* ListenFilter_hpp */
@@ -11,9 +11,20 @@
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include "Client.hpp"
+#include "MUXException.hpp"
 #include <memory>
-#include <poll.h>
+#include <vector>
+
+#ifdef __APPLE__
+#   include <sys/event.h>
+#else
+#   include <sys/epoll.h>
+#endif
+
+#define WAKE_TOKEN      ((uint64_t)-1)
+#define LISTEN_TOKEN    ((uint64_t)-2)
 
 #ifdef SOCKET_PATH
 static const char *socket_path = SOCKET_PATH;
@@ -25,7 +36,7 @@ static const char *socket_path = "/var/run/usbmuxd";
 ClientManager::ClientManager(Muxer *mux)
 : _mux(mux)
 , _clientNumber(0), _listenfd(-1)
-,_wakePipe{}
+,_wakePipe{}, _pollfd(-1)
 {
     struct sockaddr_un bind_addr = {};
     
@@ -37,11 +48,34 @@ ClientManager::ClientManager(Muxer *mux)
     strcpy(bind_addr.sun_path, socket_path);
     retassure(!bind(_listenfd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)), "bind() failed: %s", strerror(errno));
     
-    retassure(!listen(_listenfd, 5), "listen() failed: %s", strerror(errno));
+    retassure(!listen(_listenfd, CLIENT_ACCEPT_BACKLOG), "listen() failed: %s", strerror(errno));
     
     assure(!chmod(socket_path, 0666));
+
+    //accept in batches until the backlog is drained
+    assure(fcntl(_listenfd, F_SETFL, fcntl(_listenfd, F_GETFL) | O_NONBLOCK) != -1);
     
     assure(!pipe(_wakePipe));
+
+#ifdef __APPLE__
+    {
+        struct kevent kev[2] = {};
+        retassure((_pollfd = kqueue()) != -1, "kqueue() failed: %s", strerror(errno));
+        EV_SET(&kev[0], _wakePipe[0], EVFILT_READ, EV_ADD, 0, 0, (void*)WAKE_TOKEN);
+        EV_SET(&kev[1], _listenfd, EVFILT_READ, EV_ADD, 0, 0, (void*)LISTEN_TOKEN);
+        retassure(!kevent(_pollfd, kev, 2, NULL, 0, NULL), "failed to register listen socket: %s", strerror(errno));
+    }
+#else
+    {
+        struct epoll_event ev = {};
+        retassure((_pollfd = epoll_create1(EPOLL_CLOEXEC)) != -1, "epoll_create1() failed: %s", strerror(errno));
+        ev.events = EPOLLIN;
+        ev.data.u64 = WAKE_TOKEN;
+        retassure(!epoll_ctl(_pollfd, EPOLL_CTL_ADD, _wakePipe[0], &ev), "failed to register wakepipe: %s", strerror(errno));
+        ev.data.u64 = LISTEN_TOKEN;
+        retassure(!epoll_ctl(_pollfd, EPOLL_CTL_ADD, _listenfd, &ev), "failed to register listen socket: %s", strerror(errno));
+    }
+#endif
     
     _cliReaperThread = std::thread([this]{
         reaper_runloop();
@@ -74,6 +108,7 @@ ClientManager::~ClientManager(){
         int cfd = _listenfd; _listenfd = -1;
         close(cfd);
     }
+    safeClose(_pollfd);
 }
 
 void ClientManager::stopAction() noexcept{
@@ -82,15 +117,40 @@ void ClientManager::stopAction() noexcept{
 }
 
 bool ClientManager::loopEvent(){
-    int cfd = 0;
-    
-    cfd = accept_client();
-    if (cfd == -1) return true;
-    try {
-        handle_client(cfd); //always consumes cfd
-    } catch (tihmstar::exception &e) {
-        error("failed to handle client %d with error=%d",cfd,e.code());
+    int cnt = 0;
+    int timeout = handover_timeout_ms();
+#ifdef __APPLE__
+    struct kevent kev[32];
+    struct timespec ts = {.tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000};
+    if ((cnt = kevent(_pollfd, NULL, 0, kev, sizeof(kev)/sizeof(*kev), (timeout < 0) ? NULL : &ts)) == -1){
+#else
+    struct epoll_event ev[32];
+    if ((cnt = epoll_wait(_pollfd, ev, sizeof(ev)/sizeof(*ev), timeout)) == -1){
+#endif
+        retassure(errno == EINTR, "[CLIENTMANAGER] waiting for events failed errno=%d (%s)",errno,strerror(errno));
+        return true;
     }
+    for (int i=0; i<cnt; i++) {
+#ifdef __APPLE__
+        uint64_t token = (uint64_t)kev[i].udata;
+        bool isWritable = (kev[i].filter == EVFILT_WRITE);
+        bool isReadable = !isWritable;
+#else
+        uint64_t token = ev[i].data.u64;
+        bool isWritable = (ev[i].events & EPOLLOUT);
+        bool isReadable = (ev[i].events & ~EPOLLOUT); //errors and hangups are reported by recv
+#endif
+        if (token == WAKE_TOKEN) {
+            char c = 0;
+            //a byte only asks us to pick up new handover deadlines, EOF means stop
+            retassure(read(_wakePipe[0], &c, 1) == 1, "graceful kill requested");
+        } else if (token == LISTEN_TOKEN) {
+            accept_clients();
+        } else {
+            handle_client_event(token, isReadable, isWritable);
+        }
+    }
+    expire_handovers();
     return true;
 }
 
@@ -114,31 +174,34 @@ void ClientManager::reaper_runloop(){
     }
 }
 
-int ClientManager::accept_client(){
-    struct sockaddr_un addr = {};
-    int err = 0;
-    int cfd = 0;
-    socklen_t len = 0;
-    len = sizeof(struct sockaddr_un);
-    struct pollfd pfd[2] = {
-        {
-            .fd = _listenfd,
-            .events = POLLIN
-        },
-        {
-            .fd = _wakePipe[0],
-            .events = POLLIN
+void ClientManager::accept_clients(){
+    while (true) {
+        struct sockaddr_un addr = {};
+        socklen_t len = sizeof(struct sockaddr_un);
+        int cfd = -1;
+
+#ifdef __APPLE__
+        if ((cfd = accept(_listenfd, (struct sockaddr *)&addr, &len)) != -1) {
+            //accepted sockets inherit O_NONBLOCK from the listen socket here
+            fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) & ~O_NONBLOCK);
+            fcntl(cfd, F_SETFD, FD_CLOEXEC);
         }
-    };
-    if ((err = poll(pfd,2,-1)) == -1){
-        retassure(errno == EINTR, "[CLIENTMANAGER] poll failed errno=%d (%s)",errno,strerror(errno));
-        return -1;
-    }
-    retassure(!(pfd[1].revents & POLLHUP), "graceful kill requested");
-    retassure(pfd[0].revents & POLLIN, "poll returned, but there is no POLLIN event on client");
-    retassure((cfd = accept(_listenfd, (struct sockaddr *)&addr, &len))>=0, "accept() failed (%s)", strerror(errno));
-    
-    return cfd;
+#else
+        cfd = accept4(_listenfd, (struct sockaddr *)&addr, &len, SOCK_CLOEXEC);
+#endif
+        if (cfd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break; //backlog drained
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            error("accept() failed (%s)", strerror(errno));
+            break;
+        }
+
+        try {
+            handle_client(cfd); //always consumes cfd
+        } catch (tihmstar::exception &e) {
+            error("failed to handle client %d with error=%d",cfd,e.code());
+        }
+    }
 }
 
 void ClientManager::handle_client(int client_fd){
@@ -162,5 +225,175 @@ void ClientManager::handle_client(int client_fd){
     }
     
     //transfer ownership to muxer
-    _mux->add_client(client); client = NULL;
+    _mux->add_client(client);
+    try {
+        arm_client(client);
+    } catch (tihmstar::exception &e) {
+        _mux->delete_client(client);
+        throw;
+    }
+    client = NULL;
+}
+
+void ClientManager::handle_client_event(uint64_t number, bool isReadable, bool isWritable) noexcept{
+    std::shared_ptr<Client> cli;
+    bool isHandover = false;
+    {
+        std::unique_lock<std::mutex> ul(_childrenLck);
+        auto c = _armedChildren.find(number);
+        if (c == _armedChildren.end()) return; //client was disarmed in the meantime
+        cli = c->second.lock();
+        isHandover = (_handovers.find(number) != _handovers.end());
+    }
+    if (!cli) return;
+    try {
+        if (isHandover) {
+            //whatever the client sends now is connection data, errors show up when writing
+            cli->handle_writable();
+            return;
+        }
+        if (isWritable) cli->handle_writable();
+        if (isReadable) cli->recv_data();
+        return;
+    } catch (tihmstar::MUXException_client_disconnected &e){
+        debug("Client disconnected, this is fine");
+    } catch (tihmstar::exception &e) {
+        error("failed to handle client %d with error=%s code=%d",cli->_fd,e.what(),e.code());
+#ifdef DEBUG
+        e.dump();
+#endif
+    }
+    disarm_client(cli.get());
+    if (isHandover) cli->fail_handover();
+    _mux->delete_client(cli);
+}
+
+/*
+ returns how long the loop may wait for events before the next handover times out, -1 if there is none
+ */
+int ClientManager::handover_timeout_ms() noexcept{
+    std::unique_lock<std::mutex> ul(_childrenLck);
+    auto now = std::chrono::steady_clock::now();
+    int64_t ret = -1;
+    for (auto &h : _handovers) {
+        int64_t left = std::chrono::duration_cast<std::chrono::milliseconds>(h.second - now).count();
+        if (left < 0) left = 0;
+        if (ret == -1 || left < ret) ret = left;
+    }
+    return (int)ret;
+}
+
+/*
+ Drops clients which didn't take the result of their connect request in time, along with their connection
+ */
+void ClientManager::expire_handovers() noexcept{
+    std::vector<std::shared_ptr<Client>> expired;
+    {
+        std::unique_lock<std::mutex> ul(_childrenLck);
+        auto now = std::chrono::steady_clock::now();
+        for (auto &h : _handovers) {
+            if (h.second > now) continue;
+            auto c = _armedChildren.find(h.first);
+            if (c == _armedChildren.end()) continue;
+            if (std::shared_ptr<Client> cli = c->second.lock()) expired.push_back(cli);
+        }
+    }
+    for (auto &cli : expired) {
+        error("Client %d didn't accept its messages in time, dropping its connection",cli->_fd);
+        disarm_client(cli.get());
+        cli->fail_handover();
+        _mux->delete_client(cli);
+    }
+}
+
+void ClientManager::arm_client(std::shared_ptr<Client> cli){
+    std::unique_lock<std::mutex> ul(_childrenLck);
+    if (cli->_isDead) return; //client is being torn down
+#ifdef __APPLE__
+    {
+        struct kevent kev[2] = {};
+        EV_SET(&kev[0], cli->_fd, EVFILT_READ, EV_ADD, 0, 0, (void*)cli->_number);
+        EV_SET(&kev[1], cli->_fd, EVFILT_WRITE, EV_ADD | (cli->_wantsWrite ? EV_ENABLE : EV_DISABLE), 0, 0, (void*)cli->_number);
+        retassure(!kevent(_pollfd, kev, 2, NULL, 0, NULL), "failed to arm client %d: %s", cli->_fd, strerror(errno));
+    }
+#else
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | (cli->_wantsWrite ? EPOLLOUT : 0);
+        ev.data.u64 = cli->_number;
+        retassure(!epoll_ctl(_pollfd, EPOLL_CTL_ADD, cli->_fd, &ev), "failed to arm client %d: %s", cli->_fd, strerror(errno));
+    }
+#endif
+    _armedChildren[cli->_number] = cli;
+}
+
+void ClientManager::disarm_client(Client *cli) noexcept{
+    std::unique_lock<std::mutex> ul(_childrenLck);
+    _handovers.erase(cli->_number);
+    if (!_armedChildren.erase(cli->_number)) return;
+#ifdef __APPLE__
+    {
+        struct kevent kev[2] = {};
+        EV_SET(&kev[0], cli->_fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        EV_SET(&kev[1], cli->_fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        kevent(_pollfd, kev, 2, NULL, 0, NULL);
+    }
+#else
+    epoll_ctl(_pollfd, EPOLL_CTL_DEL, cli->_fd, NULL);
+#endif
+}
+
+/*
+ Arms a parked client for writability only, until it took the result of its connect request.
+ If that takes longer than CLIENT_DRAIN_TIMEOUT_MS, the client and its connection are dropped.
+ */
+void ClientManager::arm_handover(std::shared_ptr<Client> cli){
+    std::unique_lock<std::mutex> ul(_childrenLck);
+    retassure(!cli->_isDead, "client %d is being torn down", cli->_fd);
+#ifdef __APPLE__
+    {
+        struct kevent kev[2] = {};
+        EV_SET(&kev[0], cli->_fd, EVFILT_READ, EV_ADD | EV_DISABLE, 0, 0, (void*)cli->_number);
+        EV_SET(&kev[1], cli->_fd, EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, (void*)cli->_number);
+        retassure(!kevent(_pollfd, kev, 2, NULL, 0, NULL), "failed to arm client %d: %s", cli->_fd, strerror(errno));
+    }
+#else
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLOUT;
+        ev.data.u64 = cli->_number;
+        retassure(!epoll_ctl(_pollfd, EPOLL_CTL_ADD, cli->_fd, &ev), "failed to arm client %d: %s", cli->_fd, strerror(errno));
+    }
+#endif
+    _armedChildren[cli->_number] = cli;
+    _handovers[cli->_number] = std::chrono::steady_clock::now() + std::chrono::milliseconds(CLIENT_DRAIN_TIMEOUT_MS);
+    {
+        //the loop may be waiting without a timeout
+        char c = 0;
+        if (write(_wakePipe[1], &c, 1) != 1) warning("Failed to wake ClientManager for handover of client %d",cli->_fd);
+    }
+}
+
+/*
+ Waits for writability of armed clients while they have queued messages.
+ Disarmed clients pick up their current interest once they are armed again.
+ */
+void ClientManager::update_client_interest(Client *cli){
+    std::unique_lock<std::mutex> ul(_childrenLck);
+    if (_armedChildren.find(cli->_number) == _armedChildren.end()) return;
+    if (_handovers.find(cli->_number) != _handovers.end()) return; //waits for writability until it's handed over
+#ifdef __APPLE__
+    {
+        struct kevent kev = {};
+        EV_SET(&kev, cli->_fd, EVFILT_WRITE, cli->_wantsWrite ? EV_ENABLE : EV_DISABLE, 0, 0, (void*)cli->_number);
+        retassure(!kevent(_pollfd, &kev, 1, NULL, 0, NULL), "failed to update client %d: %s", cli->_fd, strerror(errno));
+    }
+#else
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | (cli->_wantsWrite ? EPOLLOUT : 0);
+        ev.data.u64 = cli->_number;
+        retassure(!epoll_ctl(_pollfd, EPOLL_CTL_MOD, cli->_fd, &ev), "failed to update client %d: %s", cli->_fd, strerror(errno));
+    }
+#endif
 }
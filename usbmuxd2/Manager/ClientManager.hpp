@@ -11,13 +11,20 @@
 #include "Muxer.hpp"
 #include <libgeneral/Manager.hpp>
 #include <libgeneral/DeliveryEvent.hpp>
+#include <map>
+#include <chrono>
+
+#define CLIENT_ACCEPT_BACKLOG 128
 
 class ClientManager : public tihmstar::Manager{
     Muxer *_mux; //not owned
     uint64_t _clientNumber;
     int _listenfd;
     int _wakePipe[2];
+    int _pollfd;
     std::set<Client *> _children; //raw ptr to shared objec
+    std::map<uint64_t, std::weak_ptr<Client>> _armedChildren; //clients in command state, keyed by client number
+    std::map<uint64_t, std::chrono::steady_clock::time_point> _handovers; //armed clients whose socket goes to a connection, with their deadline
     std::mutex _childrenLck;
     tihmstar::Event _childrenEvent;
     std::thread _cliReaperThread;
@@ -29,8 +36,16 @@ class ClientManager : public tihmstar::Manager{
 
     void reaper_runloop();
 
-    int accept_client();
-    void handle_client(int client_fd);    
+    void accept_clients();
+    void handle_client(int client_fd);
+    void handle_client_event(uint64_t number, bool isReadable, bool isWritable) noexcept;
+    int handover_timeout_ms() noexcept;
+    void expire_handovers() noexcept;
+
+    void arm_client(std::shared_ptr<Client> cli);
+    void disarm_client(Client *cli) noexcept;
+    void arm_handover(std::shared_ptr<Client> cli);
+    void update_client_interest(Client *cli);
 public:
     ClientManager(Muxer *mux);
     virtual ~ClientManager() override;
@@ -0,0 +1,193 @@
+//
+//  TCPManager.cpp
+//  usbmuxd2
+//
+
+#include "TCPManager.hpp"
+#include "../TCP.hpp"
+#include <libgeneral/macros.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __APPLE__
+#   include <sys/event.h>
+#else
+#   include <sys/epoll.h>
+#endif
+
+#define WAKE_TOKEN 0
+
+#pragma mark TCPManager
+TCPManager::TCPManager(unsigned workers)
+: _pollfd(-1), _wakePipe{-1,-1}
+, _nextToken(WAKE_TOKEN)
+{
+    bool didInit = false;
+    cleanup([&]{
+        if (!didInit) {
+            safeClose(_wakePipe[1]); //wakes up workers which were already started
+            for (auto &w : _workers) w.join();
+            safeClose(_wakePipe[0]);
+            safeClose(_pollfd);
+        }
+    });
+
+    if (!workers) {
+        workers = std::thread::hardware_concurrency();
+        if (workers > TCP_WORKERS_DEFAULT_MAX) workers = TCP_WORKERS_DEFAULT_MAX;
+        if (!workers) workers = 1;
+    }
+
+    assure(!pipe(_wakePipe));
+#ifdef __APPLE__
+    {
+        struct kevent kev = {};
+        retassure((_pollfd = kqueue()) != -1, "kqueue() failed: %s", strerror(errno));
+        EV_SET(&kev, _wakePipe[0], EVFILT_READ, EV_ADD, 0, 0, (void*)WAKE_TOKEN);
+        retassure(!kevent(_pollfd, &kev, 1, NULL, 0, NULL), "failed to register wakepipe: %s", strerror(errno));
+    }
+#else
+    {
+        struct epoll_event ev = {};
+        retassure((_pollfd = epoll_create1(EPOLL_CLOEXEC)) != -1, "epoll_create1() failed: %s", strerror(errno));
+        ev.events = EPOLLIN; //level triggered, so closing the pipe wakes up all workers
+        ev.data.u64 = WAKE_TOKEN;
+        retassure(!epoll_ctl(_pollfd, EPOLL_CTL_ADD, _wakePipe[0], &ev), "failed to register wakepipe: %s", strerror(errno));
+    }
+#endif
+
+    info("Starting TCPManager with %u workers",workers);
+    _workers.reserve(workers);
+    for (unsigned i=0; i<workers; i++) {
+        _workers.emplace_back([this]{
+            worker_runloop();
+        });
+    }
+    didInit = true;
+}
+
+TCPManager::~TCPManager(){
+    info("[destroying] TCPManager");
+    safeClose(_wakePipe[1]);
+    for (auto &w : _workers) w.join();
+    {
+        std::unique_lock<std::mutex> ul(_connsLck);
+        if (_conns.size()) {
+            warning("TCPManager destroyed with %zu connections still registered",_conns.size());
+        }
+        _conns.clear();
+    }
+    safeClose(_wakePipe[0]);
+    safeClose(_pollfd);
+}
+
+void TCPManager::worker_runloop() noexcept{
+#ifdef __APPLE__
+    struct kevent kev[16];
+#else
+    struct epoll_event ev[16];
+#endif
+    while (true) {
+        int cnt = 0;
+#ifdef __APPLE__
+        if ((cnt = kevent(_pollfd, NULL, 0, kev, sizeof(kev)/sizeof(*kev), NULL)) == -1) {
+#else
+        if ((cnt = epoll_wait(_pollfd, ev, sizeof(ev)/sizeof(*ev), -1)) == -1) {
+#endif
+            if (errno == EINTR) continue;
+            error("[TCPManager] waiting for events failed errno=%d (%s)",errno,strerror(errno));
+            break;
+        }
+        for (int i=0; i<cnt; i++) {
+            uint32_t events = CLIENT_EVENT_NONE;
+#ifdef __APPLE__
+            uint64_t token = (uint64_t)kev[i].udata;
+            if (token == WAKE_TOKEN) return;
+            if (kev[i].flags & (EV_EOF | EV_ERROR)) events |= CLIENT_EVENT_HUP;
+            if (kev[i].filter == EVFILT_READ) events |= CLIENT_EVENT_READ;
+            if (kev[i].filter == EVFILT_WRITE) events |= CLIENT_EVENT_WRITE;
+#else
+            uint64_t token = ev[i].data.u64;
+            if (token == WAKE_TOKEN) return;
+            if (ev[i].events & (EPOLLHUP | EPOLLERR)) events |= CLIENT_EVENT_HUP;
+            if (ev[i].events & EPOLLIN) events |= CLIENT_EVENT_READ;
+            if (ev[i].events & EPOLLOUT) events |= CLIENT_EVENT_WRITE;
+#endif
+            dispatch(token, events);
+        }
+    }
+}
+
+void TCPManager::dispatch(uint64_t token, uint32_t events) noexcept{
+    std::shared_ptr<TCP> conn;
+    {
+        std::unique_lock<std::mutex> ul(_connsLck);
+        auto c = _conns.find(token);
+        if (c == _conns.end()) return; //connection was removed in the meantime
+        conn = c->second;
+    }
+    try {
+        conn->handle_client_events(events);
+    } catch (tihmstar::exception &e) {
+        error("[TCPManager] failed to handle events=0x%x on connection with error=%d (%s)",events,e.code(),e.what());
+        conn->kill(__LINE__);
+    }
+}
+
+void TCPManager::arm(uint64_t token, int fd, uint32_t interest, bool isNew){
+#ifdef __APPLE__
+    struct kevent kev[2] = {};
+    uint16_t common = (isNew ? EV_ADD : 0) | EV_DISPATCH;
+    EV_SET(&kev[0], fd, EVFILT_READ, common | ((interest & CLIENT_EVENT_READ) ? EV_ENABLE : EV_DISABLE), 0, 0, (void*)token);
+    EV_SET(&kev[1], fd, EVFILT_WRITE, common | ((interest & CLIENT_EVENT_WRITE) ? EV_ENABLE : EV_DISABLE), 0, 0, (void*)token);
+    retassure(!kevent(_pollfd, kev, 2, NULL, 0, NULL), "failed to arm fd=%d: %s", fd, strerror(errno));
+#else
+    struct epoll_event ev = {};
+    ev.events = EPOLLONESHOT;
+    if (interest & CLIENT_EVENT_READ) ev.events |= EPOLLIN;
+    if (interest & CLIENT_EVENT_WRITE) ev.events |= EPOLLOUT;
+    ev.data.u64 = token;
+    retassure(!epoll_ctl(_pollfd, isNew ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev), "failed to arm fd=%d: %s", fd, strerror(errno));
+#endif
+}
+
+#pragma mark public
+uint64_t TCPManager::add_connection(std::shared_ptr<TCP> conn, int fd, uint32_t interest){
+    uint64_t token = 0;
+    std::unique_lock<std::mutex> ul(_connsLck);
+    token = ++_nextToken;
+    _conns[token] = conn;
+    try {
+        arm(token, fd, interest, true);
+    } catch (...) {
+        _conns.erase(token);
+        throw;
+    }
+    return token;
+}
+
+void TCPManager::rearm_connection(uint64_t token, int fd, uint32_t interest){
+    arm(token, fd, interest, false);
+}
+
+void TCPManager::remove_connection(uint64_t token, int fd) noexcept{
+    std::shared_ptr<TCP> conn; //release only after unlocking, this may be the last reference
+    {
+        std::unique_lock<std::mutex> ul(_connsLck);
+        auto c = _conns.find(token);
+        if (c == _conns.end()) return;
+        conn = c->second;
+        _conns.erase(c);
+#ifdef __APPLE__
+        {
+            struct kevent kev[2] = {};
+            EV_SET(&kev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+            EV_SET(&kev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+            kevent(_pollfd, kev, 2, NULL, 0, NULL);
+        }
+#else
+        epoll_ctl(_pollfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    }
+}
@@ -0,0 +1,59 @@
+//
+//  TCPManager.hpp
+//  usbmuxd2
+//
+
+#ifndef TCPManager_hpp
+#define TCPManager_hpp
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define TCP_WORKERS_DEFAULT_MAX 4
+
+class TCP;
+
+/*
+ Data plane for all client sockets of TCP connections.
+ A small pool of worker threads waits on a single epoll (kqueue on darwin) instance.
+ Sockets are armed oneshot, so every connection is handled by at most one worker at a time
+ and needs to be rearmed with its current interest after each event.
+ */
+class TCPManager {
+public:
+    enum client_events : uint32_t {
+        CLIENT_EVENT_NONE   = 0,
+        CLIENT_EVENT_READ   = 1 << 0,
+        CLIENT_EVENT_WRITE  = 1 << 1,
+        CLIENT_EVENT_HUP    = 1 << 2,
+    };
+private:
+    int _pollfd;
+    int _wakePipe[2];
+    uint64_t _nextToken;
+    std::map<uint64_t, std::shared_ptr<TCP>> _conns;
+    std::mutex _connsLck;
+    std::vector<std::thread> _workers;
+
+    void worker_runloop() noexcept;
+    void dispatch(uint64_t token, uint32_t events) noexcept;
+    void arm(uint64_t token, int fd, uint32_t interest, bool isNew);
+
+public:
+    TCPManager(unsigned workers = 0);
+    ~TCPManager();
+
+    /*
+     returns a token identifying the connection towards the manager.
+     The manager keeps conn alive until it is removed again.
+     */
+    uint64_t add_connection(std::shared_ptr<TCP> conn, int fd, uint32_t interest);
+    void rearm_connection(uint64_t token, int fd, uint32_t interest);
+    void remove_connection(uint64_t token, int fd) noexcept;
+};
+
+#endif /* TCPManager_hpp */
@@ -130,24 +130,25 @@ void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept{
 
         info("Got serial '%s' for device %d-%d", usbdev->_serial, usbdev->_bus, usbdev->_address);
 
-        // Spin up NUM_RX_LOOPS parallel usb data retrieval loops
+        // Spin up _rx_depthMin parallel usb data retrieval loops
         // Old usbmuxds used only 1 rx loop, but that leaves the
-        // USB port sleeping most of the time
+        // USB port sleeping most of the time. rx_callback adds more
+        // loops up to _rx_depthMax while the device is streaming
         {
-            int rx_loops = 0;
-            for (; rx_loops < NUM_RX_LOOPS; rx_loops++) {
+            unsigned rx_loops = 0;
+            for (; rx_loops < usbdev->_rx_depthMin; rx_loops++) {
                 try {
                     usb_start_rx_loop(usbdev);
                 } catch (tihmstar::exception &e) {
-                    warning("Failed to start RX loop number %d", NUM_RX_LOOPS - rx_loops);
+                    warning("Failed to start RX loop number %u", usbdev->_rx_depthMin - rx_loops);
                 }
             }
             // Ensure we have at least 1 RX loop going
             retassure(rx_loops, "Failed to start any RX loop for device %d-%d", usbdev->_bus, usbdev->_address);
-            if (rx_loops != NUM_RX_LOOPS) {
-                warning("Failed to start all %d RX loops. Going on with %d loops. This may have negative impact on device read speed.", NUM_RX_LOOPS, rx_loops);
+            if (rx_loops != usbdev->_rx_depthMin) {
+                warning("Failed to start all %u RX loops. Going on with %u loops. This may have negative impact on device read speed.", usbdev->_rx_depthMin, rx_loops);
             } else {
-                debug("All %d RX loops started successfully", NUM_RX_LOOPS);
+                debug("All %u RX loops started successfully", usbdev->_rx_depthMin);
             }
         }
 
@@ -170,35 +171,36 @@ void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept{
 
 // Start a read-callback loop for this device
 void usb_start_rx_loop(std::shared_ptr<USBDevice> dev){
-    void *buf = NULL;
+    unsigned char *buf = NULL;
     struct libusb_transfer *xfer = NULL;
-    std::shared_ptr<USBDevice> *devrefarg = nullptr;
+    USBDevice::rx_xfer_ctx *ctx = nullptr;
     cleanup([&](){ //cleanup only code
-        safeDelete(devrefarg);
-        safeFree(buf);
+        safeDelete(ctx);
+        dev->rx_buffer_put(buf);
         if (xfer) {
             {
                 guardWrite(dev->_rx_xfers_Guard);
                 dev->_rx_xfers.erase(xfer);
             }
-            safeFree(xfer->buffer);
+            dev->rx_buffer_put(xfer->buffer); xfer->buffer = NULL;
             {
-                std::shared_ptr<USBDevice>* ud = (std::shared_ptr<USBDevice>*)xfer->user_data;xfer->user_data = NULL;
-                safeDelete(ud);
+                USBDevice::rx_xfer_ctx *c = (USBDevice::rx_xfer_ctx*)xfer->user_data;xfer->user_data = NULL;
+                safeDelete(c);
             }
             libusb_free_transfer(xfer);
         }
     });
     int ret = 0;
 
-    assure(buf = malloc(USB_MRU));
+    retassure(buf = dev->rx_buffer_get(), "Out of RX buffers");
     assure(xfer = libusb_alloc_transfer(0));
     xfer->user_data = NULL;
 
-    devrefarg = new std::shared_ptr<USBDevice>{dev};
-    libusb_fill_bulk_transfer(xfer, dev->_usbdev, dev->_ep_in, (unsigned char *)buf, USB_MRU, rx_callback, devrefarg, 0);
+    ctx = new USBDevice::rx_xfer_ctx{dev};
+    libusb_fill_bulk_transfer(xfer, dev->_usbdev, dev->_ep_in, buf, USB_MRU, rx_callback, ctx, 0);
     buf = NULL; //owned by xfer now
-    devrefarg = nullptr; //owned by xfer now
+    ctx->submitted = std::chrono::steady_clock::now();
+    ctx = nullptr; //owned by xfer now
 
     {
         guardWrite(dev->_rx_xfers_Guard);
@@ -210,10 +212,45 @@ void usb_start_rx_loop(std::shared_ptr<USBDevice> dev){
 }
 
 void rx_callback(struct libusb_transfer *xfer) noexcept{
-    std::shared_ptr<USBDevice> dev = *(std::shared_ptr<USBDevice> *)xfer->user_data;
+    USBDevice::rx_xfer_ctx *ctx = (USBDevice::rx_xfer_ctx *)xfer->user_data;
+    std::shared_ptr<USBDevice> dev = ctx->dev;
+    bool isRetired = false;
 //    debug("RX callback dev %d-%d len %d status %d", dev->_bus, dev->_address, xfer->actual_length, xfer->status);
     if(xfer->status == LIBUSB_TRANSFER_COMPLETED) {
-        dev->_arrived_xfer.post(xfer);
+        USBDevice::rx_packet pkt = {xfer->buffer, (uint32_t)xfer->actual_length, NULL};
+        unsigned char *fresh = dev->rx_buffer_get();
+        int adapt = dev->rx_adapt(pkt.len, std::chrono::steady_clock::now() - ctx->submitted, !fresh);
+        if (adapt < 0) {
+            //device is not streaming (anymore), drop this transfer once its buffer was handed to the parser
+            dev->rx_buffer_put(fresh);
+            xfer->buffer = NULL;
+            dev->_arrived_xfer.post(pkt);
+            isRetired = true;
+            goto error;
+        } else if (fresh) {
+            //keep the endpoint busy while the filled buffer is being parsed
+            int ret = 0;
+            xfer->buffer = fresh;
+            ctx->submitted = std::chrono::steady_clock::now();
+            if ((ret = libusb_submit_transfer(xfer))) {
+                error("Failed to resubmit RX transfer for device %d-%d: %d", dev->_bus, dev->_address, ret);
+                //the data was received already, it still needs to be parsed or the stream has a gap
+                dev->_arrived_xfer.post(pkt);
+                isRetired = true;
+                goto error;
+            }
+        } else {
+            //parser is behind, resubmit only once it's done with this buffer
+            pkt.xfer = xfer;
+        }
+        dev->_arrived_xfer.post(pkt);
+        if (adapt > 0) {
+            try {
+                usb_start_rx_loop(dev);
+            } catch (tihmstar::exception &e) {
+                debug("Failed to add RX loop for device %d-%d: %s", dev->_bus, dev->_address, e.what());
+            }
+        }
         return;
     }
     switch(xfer->status) {
@@ -247,17 +284,16 @@ error:
     {
         guardWrite(dev->_rx_xfers_Guard);
         dev->_rx_xfers.erase(xfer);
+        if (!dev->_rx_xfers.size()) isRetired = false; //nothing left to receive with
     }
 
     debug("freing rx xfer for USBDevice(%s)",dev->_serial);
-    safeFree(xfer->buffer);
-    {
-        std::shared_ptr<USBDevice> *cbargref = (std::shared_ptr<USBDevice> *)xfer->user_data; xfer->user_data = NULL;
-        safeDelete(cbargref);
-    }
+    dev->rx_buffer_put(xfer->buffer); xfer->buffer = NULL;
+    xfer->user_data = NULL;
+    safeDelete(ctx);
     libusb_free_transfer(xfer);
 
-    dev->kill();
+    if (!isRetired) dev->kill();
 }
 
 #pragma mark USBDeviceManager
@@ -496,6 +532,7 @@ found_device:;
     }
     
     info("USB Speed is %g MBit/s for device %d-%d", (double)(newDevice->_speed / 1000000.0), newDevice->_bus, newDevice->_address);
+    newDevice->apply_speed_profile();
 
 
     /**
@@ -0,0 +1,79 @@
+//
+//  MirrorRing.cpp
+//  usbmuxd2
+//
+
+#include "MirrorRing.hpp"
+#include <libgeneral/macros.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __APPLE__
+#   include <atomic>
+#   include <stdio.h>
+#endif
+
+#pragma mark MirrorRing
+MirrorRing::MirrorRing(size_t size)
+: _fd(-1), _base((char*)MAP_FAILED), _size(size)
+{
+    bool didInit = false;
+    cleanup([&]{
+        if (!didInit) {
+            if (_base != MAP_FAILED) munmap(_base, _size*2);
+            safeClose(_fd);
+        }
+    });
+    size_t pagesize = (size_t)getpagesize();
+    retassure(_size && _size % pagesize == 0, "MirrorRing size 0x%zx is not a multiple of the page size", _size);
+
+#ifdef __APPLE__
+    {
+        //no memfd here, use an anonymous shm object instead
+        static std::atomic<uint32_t> ringCnt{0};
+        char name[64] = {};
+        snprintf(name, sizeof(name), "/usbmuxd2.ring.%d.%u", getpid(), ringCnt++);
+        retassure((_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) != -1, "shm_open failed: %s", strerror(errno));
+        shm_unlink(name);
+    }
+#else
+    retassure((_fd = memfd_create("usbmuxd2-ring", MFD_CLOEXEC)) != -1, "memfd_create failed: %s", strerror(errno));
+#endif
+    retassure(!ftruncate(_fd, _size), "Failed to size ring to 0x%zx: %s", _size, strerror(errno));
+
+    //reserve address space for both views first, so they are guaranteed to be adjacent
+    retassure((_base = (char*)mmap(NULL, _size*2, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0)) != MAP_FAILED, "Failed to reserve ring: %s", strerror(errno));
+    retassure(mmap(_base, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, _fd, 0) != MAP_FAILED, "Failed to map ring: %s", strerror(errno));
+    retassure(mmap(_base + _size, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, _fd, 0) != MAP_FAILED, "Failed to map ring mirror: %s", strerror(errno));
+    didInit = true;
+}
+
+MirrorRing::~MirrorRing(){
+    if (_base != MAP_FAILED) {
+        munmap(_base, _size*2); _base = (char*)MAP_FAILED;
+    }
+    safeClose(_fd);
+}
+
+void MirrorRing::release(size_t offset, size_t length) noexcept{
+    size_t pagesize = (size_t)getpagesize();
+    size_t start = (offset + pagesize - 1) & ~(pagesize - 1);
+    size_t end = (offset + length) & ~(pagesize - 1);
+    if (end > _size) end = _size;
+    if (start >= end) return;
+#ifdef __APPLE__
+    madvise(_base + start, end - start, MADV_FREE);
+    madvise(_base + _size + start, end - start, MADV_FREE);
+#else
+    /*
+        MADV_DONTNEED would only drop our page table entries, the pages would stay in the memfd.
+        MADV_REMOVE frees the backing store, which empties both views at once.
+     */
+    if (madvise(_base + start, end - start, MADV_REMOVE)) {
+        debug("Failed to release ring pages: %s", strerror(errno));
+    }
+#endif
+}
@@ -0,0 +1,34 @@
+//
+//  MirrorRing.hpp
+//  usbmuxd2
+//
+
+#ifndef MirrorRing_hpp
+#define MirrorRing_hpp
+
+#include <stddef.h>
+
+/*
+ Ring buffer memory which is mapped twice back to back, so every range of up to size()
+ bytes starting inside the ring is contiguous and never needs to be split at the wrap point.
+ Pages are only committed once they are touched and can be given back with release().
+ */
+class MirrorRing {
+    int _fd;
+    char *_base;
+    size_t _size;
+
+public:
+    MirrorRing(size_t size); //size needs to be a multiple of the page size
+    ~MirrorRing();
+
+    char *at(size_t offset) const noexcept {return _base + offset;} //offset needs to be less than size()
+    size_t size() const noexcept {return _size;}
+
+    /*
+     drops the contents of the pages inside [offset, offset+length) and hands their memory back to the system
+     */
+    void release(size_t offset, size_t length) noexcept;
+};
+
+#endif /* MirrorRing_hpp */
@@ -9,6 +9,7 @@
 #include "Devices/USBDevice.hpp"
 #include "Manager/USBDeviceManager.hpp"
 #include "Manager/ClientManager.hpp"
+#include "Manager/TCPManager.hpp"
 #include "Manager/WIFIDeviceManager-direct.hpp"
 #include "Client.hpp"
 #include "sysconf/preflight.hpp"
@@ -37,9 +38,9 @@
 extern Config *gConfig;
 
 Muxer::Muxer(bool doPreflight, bool allowHeartlessWifi)
-: _climgr(nullptr), _usbdevmgr(nullptr), _wifidevmgr(nullptr)
+: _climgr(nullptr), _usbdevmgr(nullptr), _wifidevmgr(nullptr), _tcpmgr(nullptr)
 , _doPreflight(doPreflight), _allowHeartlessWifi(allowHeartlessWifi)
-, _newid(1)
+, _deviceListGeneration(0)
 {
     info("Starting Muxer: preflight=%s allowHeartlessWifi=%s", doPreflight ? "YES" : "NO"
                                                              , allowHeartlessWifi ? "YES" : "NO");
@@ -51,6 +52,7 @@ Muxer::~Muxer(){
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
     safeDelete(_wifidevmgr);
 #endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+    safeDelete(_tcpmgr); //connections are gone with their devices
 }
 
 #pragma mark Managers
@@ -85,85 +87,98 @@ void Muxer::spawnWIFIDeviceManager(const std::string &connectIP){
     _wifidevmgr->startLoop();
 }
 
+void Muxer::spawnTCPManager(unsigned workers){
+    assure(!_tcpmgr);
+    _tcpmgr = new TCPManager(workers);
+}
+
 bool Muxer::hasDeviceManager() noexcept{
     return !!_usbdevmgr || !!_wifidevmgr;
 }
 
+TCPManager *Muxer::getTCPManager() noexcept{
+    return _tcpmgr;
+}
+
 #pragma mark Clients
 void Muxer::add_client(std::shared_ptr<Client> cli){
     debug("add_client %d",cli->_fd);
-    _clientsGuard.lockMember();
-    _clients.insert(cli);
-    try{
-        cli->startLoop();
-    }catch(tihmstar::exception &e){
-        _clientsGuard.unlockMember();
-        delete_client(cli);
-        throw;
-    }
-    _clientsGuard.unlockMember();
+    _clients.update([&](std::set<std::shared_ptr<Client>> &clients){
+        clients.insert(cli);
+    });
 }
 
 void Muxer::delete_client(int cli_fd) noexcept{
+    std::shared_ptr<Client> cli;
     debug("delete_client fd %d",cli_fd);
-    _clientsGuard.lockMember();
-    for (auto c : _clients) {
-        if (c->_fd == cli_fd) {
-            _clients.erase(c);
-            _clientsGuard.unlockMember();
-            c->kill();
-            return;
+    {
+        auto clients = _clients.read();
+        for (auto &c : *clients) {
+            if (c->_fd == cli_fd) {
+                cli = c;
+                break;
+            }
         }
     }
-    _clientsGuard.unlockMember();
+    if (cli) delete_client(cli);
 }
 
 void Muxer::delete_client(std::shared_ptr<Client> cli) noexcept{
+    bool didErase = false;
     debug("delete_client %d",cli->_fd);
-    _clientsGuard.lockMember();
-    if (_clients.erase(cli)) {
-        _clientsGuard.unlockMember();
-        cli->kill();
-    }else{
-        _clientsGuard.unlockMember();
+    try {
+        _clients.update([&](std::set<std::shared_ptr<Client>> &clients){
+            didErase = clients.erase(cli);
+        });
+    } catch (...) {
+        error("Failed to remove client %d",cli->_fd);
     }
+    try {
+        _listeners.update([&](ListenerTable &listeners){
+            listeners.erase(cli, cli->_listenFilter);
+        });
+    } catch (...) {
+        error("Failed to remove listener %d",cli->_fd);
+    }
+    if (didErase) cli->kill();
+}
+
+/*
+ (re)registers cli as listener, replacing the filter of a previous Listen request
+ */
+void Muxer::add_listener(std::shared_ptr<Client> cli, std::shared_ptr<const ListenFilter> filter){
+    debug("add_listener %d",cli->_fd);
+    _listeners.update([&](ListenerTable &listeners){
+        listeners.erase(cli, cli->_listenFilter);
+        listeners.insert(cli, filter);
+        cli->_listenFilter = filter;
+    });
 }
 
 #pragma mark Devices
 void Muxer::add_device(std::shared_ptr<Device> dev, bool notify) {
     debug("add_device %s", dev->_serial);
 
-    // Get id of already connected device but with the other connection type
-    // Discard the id-based connection type information
-    dev->_id = id_for_device(dev->_serial, dev->_conntype == Device::MUXCONN_USB ? Device::MUXCONN_WIFI : Device::MUXCONN_USB) & ~1;
-
-    if (!dev->_id) {
-        // There can be no device with ID 1 or 0
-        // Thus if id is 0 then this is the device's first connection
-        // Assign it a fresh ID
-        guardRead(_devicesGuard);
-    retryID:
-        for (auto odev : _devices) {
-            if ((odev->_id >> 1) == _newid) {
-                _newid++;
-                if (_newid > MAXID) {
-                    _newid = 1;
-                    goto retryID;
-                }
-            }
+    _devices.update([&](DeviceTable &devices){
+        // Get id of already connected device but with the other connection type
+        // Discard the id-based connection type information
+        auto &siblings = devices.bySerial(dev->_conntype == Device::MUXCONN_USB ? Device::MUXCONN_WIFI : Device::MUXCONN_USB);
+        auto sibling = siblings.find(dev->_serial);
+        if (sibling != siblings.end()) {
+            dev->_id = sibling->second->_id & ~1;
+        } else {
+            // There can be no device with ID 1 or 0
+            // Thus this is the device's first connection
+            // Assign it a fresh ID
+            dev->_id = (devices.alloc_baseid() << 1);
         }
-        dev->_id = (_newid << 1);
-    }
 
-    // Fixup connection information in ID
-    dev->_id |= (dev->_conntype == Device::MUXCONN_WIFI);
+        // Fixup connection information in ID
+        dev->_id |= (dev->_conntype == Device::MUXCONN_WIFI);
 
-    debug("Muxer: adding device %s assigning id %d", dev->_serial, dev->_id);
-
-    {
-        guardWrite(_devicesGuard);
-        _devices.insert(dev);
-    }
+        debug("Muxer: adding device %s assigning id %d", dev->_serial, dev->_id);
+        devices.insert(dev);
+    });
 
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
     if (dev->_conntype == Device::MUXCONN_WIFI) {
@@ -195,88 +210,73 @@ void Muxer::add_device(std::shared_ptr<Device> dev, bool notify) {
 }
 
 void Muxer::delete_device(std::shared_ptr<Device> dev) noexcept {
-    {
-        guardWrite(_devicesGuard);
-        _devices.erase(dev);
+    std::shared_ptr<const DeviceChange> change;
+    try {
+        _devices.update([&](DeviceTable &devices){
+            change = devices.erase(dev);
+        });
+    } catch (...) {
+        error("Failed to remove device %s", dev->_serial);
+    }
+    if (change) {
+        notify_listeners(*change->encoded, change->subject, Client::NOTIFY_DETACHED);
+    } else {
+        notify_device_remove(dev);
     }
-    notify_device_remove(dev->_id);
 }
 
 void Muxer::delete_device(uint8_t bus, uint8_t address) noexcept {
-    int devid = INVALID_ID;
+    std::shared_ptr<Device> dev;
     {
-        guardWrite(_devicesGuard);
-        for (auto dev : _devices){
-            if (dev->_conntype == Device::MUXCONN_USB) {
-                USBDevice *usbdev = (USBDevice*)dev.get();
-                if (usbdev->usb_location() == (((uint16_t)bus << 16) | address)){
-                    devid = dev->_id;
-                    _devices.erase(dev);
-                    break;
-                }
-            }
-        }
+        auto devices = _devices.read();
+        auto d = devices->usbByLocation.find(((uint32_t)bus << 16) | address);
+        if (d == devices->usbByLocation.end()) return;
+        dev = d->second;
     }
-    if (devid != INVALID_ID) notify_device_remove(devid);
+    delete_device(dev);
 }
 
 void Muxer::delete_wifi_pairing_device_with_ip(std::vector<std::string> ipaddrs) noexcept{
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
-    guardWrite(_devicesGuard);
-    for (auto dev : _devices){
-        if (dev->_conntype == Device::MUXCONN_WIFI) {
-            WIFIDevice *wifidev = (WIFIDevice*)dev.get();
-            for (auto nip : ipaddrs) {
-                if (strncmp(wifidev->_serial, "WIFIPAIR", sizeof("WIFIPAIR")-1) == 0 &&
-                    std::find(wifidev->_ipaddr.begin(), wifidev->_ipaddr.end(), nip) != wifidev->_ipaddr.end()) {
-                    _devices.erase(dev);
-                    return;
+    std::shared_ptr<Device> dev;
+    {
+        auto devices = _devices.read();
+        for (auto nip : ipaddrs) {
+            auto range = devices->wifiByIP.equal_range(nip);
+            for (auto d = range.first; d != range.second; d++) {
+                if (strncmp(d->second->_serial, "WIFIPAIR", sizeof("WIFIPAIR")-1) == 0) {
+                    dev = d->second;
+                    goto found_device;
                 }
             }
         }
+        return;
+    found_device:;
     }
+    delete_device(dev); //logs the Detached change and tells listeners about it
 #endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
 }
 
 bool Muxer::have_usb_device(uint8_t bus, uint8_t address) noexcept {
-    guardRead(_devicesGuard);
-    for (auto dev : _devices){
-        if (dev->_conntype == Device::MUXCONN_USB) {
-            USBDevice *usbdev = (USBDevice*)dev.get();
-            if (usbdev->usb_location() == (((uint16_t)bus << 16) | address)){
-                return true;
-            }
-        }
-    }
-    return false;
+    auto devices = _devices.read();
+    return devices->usbByLocation.find(((uint32_t)bus << 16) | address) != devices->usbByLocation.end();
 }
 
 bool Muxer::have_wifi_device_with_mac(std::string macaddr) noexcept{
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
-    guardRead(_devicesGuard);
-    for (auto dev : _devices){
-        if (dev->_conntype == Device::MUXCONN_WIFI) {
-            WIFIDevice *wifidev = (WIFIDevice*)dev.get();
-            if (wifidev->_serviceName.substr(0,wifidev->_serviceName.find("@")) == macaddr) {
-                return true;
-            }
-        }
-    }
-#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+    auto devices = _devices.read();
+    return devices->wifiByMac.find(macaddr) != devices->wifiByMac.end();
+#else
     return false;
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
 }
 
 bool Muxer::have_wifi_device_with_ip(std::vector<std::string> ipaddrs) noexcept{
 #if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
-    guardRead(_devicesGuard);
-    for (auto dev : _devices){
-        if (dev->_conntype == Device::MUXCONN_WIFI) {
-            WIFIDevice *wifidev = (WIFIDevice*)dev.get();
-            for (auto nip : ipaddrs) {
-                if (std::find(wifidev->_ipaddr.begin(), wifidev->_ipaddr.end(), nip) != wifidev->_ipaddr.end()) {
-                    return true;
-                }
-            }
+    auto devices = _devices.read();
+    for (auto nip : ipaddrs) {
+        if (devices->wifiByIP.find(nip) != devices->wifiByIP.end()) {
+            return true;
         }
     }
 #endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
@@ -285,62 +285,257 @@ bool Muxer::have_wifi_device_with_ip(std::vector<std::string> ipaddrs) noexcept{
 
 
 int Muxer::id_for_device(const char *uuid, Device::mux_conn_type type) noexcept {
+    auto devices = _devices.read();
+    auto &bySerial = devices->bySerial(type);
+    auto d = bySerial.find(uuid);
+    return (d != bySerial.end()) ? d->second->_id : 0;
+}
+
+size_t Muxer::devices_cnt() noexcept {
+    return _devices.read()->byID.size();
+}
+
+#pragma mark DeviceTable
+std::unordered_multimap<std::string, std::shared_ptr<Device>> &Muxer::DeviceTable::bySerial(Device::mux_conn_type type) noexcept{
+    return (type == Device::MUXCONN_WIFI) ? wifiBySerial : usbBySerial;
+}
+
+const std::unordered_multimap<std::string, std::shared_ptr<Device>> &Muxer::DeviceTable::bySerial(Device::mux_conn_type type) const noexcept{
+    return (type == Device::MUXCONN_WIFI) ? wifiBySerial : usbBySerial;
+}
+
+/*
+ IDs are handed out round robin, so an ID isn't reused right after its device went away
+ */
+int Muxer::DeviceTable::alloc_baseid() noexcept{
     int ret = 0;
-    guardRead(_devicesGuard);
-    for (auto dev : _devices){
-        if (dev->_conntype == type && strcmp(uuid,dev->_serial) == 0) {
-            ret = dev->_id;
-            break;
-        }
+    while (baseIDRefs.find(newid) != baseIDRefs.end()) {
+        if (++newid > MAXID) newid = 1;
     }
+    ret = newid;
+    if (++newid > MAXID) newid = 1;
     return ret;
 }
 
-size_t Muxer::devices_cnt() noexcept {
-    guardRead(_devicesGuard);
-    return _devices.size();
+/*
+ bumps the generation, stamps msg with it and appends it to the change log
+ */
+std::shared_ptr<const Muxer::DeviceChange> Muxer::DeviceTable::log_change(const ListenFilter::subject &subject, int kind, plist_t msg){
+    std::shared_ptr<const DeviceChange> change;
+    {
+        plist_t p_msg = msg;
+        cleanup([&]{
+            safeFreeCustom(p_msg, plist_free);
+        });
+        assure(p_msg);
+        plist_dict_set_item(p_msg, "Generation", plist_new_uint(generation+1));
+        change = std::make_shared<const DeviceChange>(generation+1, subject, kind, p_msg); p_msg = NULL; //transfer ownership
+    }
+    changes.push_back(change);
+    while (changes.size() > DEVICE_CHANGELOG_MAX) changes.pop_front();
+    generation++;
+    return change;
+}
+
+/*
+ returns true if every change after generation since is still in the log
+ */
+bool Muxer::DeviceTable::covers(uint64_t since) const noexcept{
+    if (since > generation) return false; //generation from before a restart
+    if (since == generation) return true;
+    return changes.size() && changes.front()->generation <= since+1;
+}
+
+void Muxer::DeviceTable::insert(std::shared_ptr<Device> dev){
+    retassure(byID.find(dev->_id) == byID.end(), "Device ID %d is already in use, can't add device %s", dev->_id, dev->_serial);
+    attachedMsgs[dev->_id] = log_change(getDeviceSubject(dev), Client::NOTIFY_ATTACHED, getDevicePlist(dev))->encoded;
+    byID[dev->_id] = dev;
+    baseIDRefs[dev->_id >> 1]++;
+    //duplicates happen if a device is replugged before its old instance went away, both stay findable until then
+    bySerial(dev->_conntype).emplace(dev->_serial, dev);
+    if (dev->_conntype == Device::MUXCONN_USB) {
+        USBDevice *usbdev = (USBDevice*)dev.get();
+        usbByLocation.emplace(usbdev->usb_location(), dev);
+    }
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+    if (dev->_conntype == Device::MUXCONN_WIFI) {
+        WIFIDevice *wifidev = (WIFIDevice*)dev.get();
+        wifiByMac.emplace(wifidev->_serviceName.substr(0,wifidev->_serviceName.find("@")), dev);
+        for (auto &ip : wifidev->_ipaddr) {
+            wifiByIP.emplace(ip, dev);
+        }
+    }
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+}
+
+/*
+ returns the logged Detached change, or nullptr if dev wasn't registered
+ */
+std::shared_ptr<const Muxer::DeviceChange> Muxer::DeviceTable::erase(std::shared_ptr<Device> dev){
+    std::shared_ptr<const DeviceChange> change;
+    auto eraseDevice = [&dev](auto &index, const auto &key){
+        auto range = index.equal_range(key);
+        for (auto d = range.first; d != range.second; d++) {
+            if (d->second == dev) {
+                index.erase(d);
+                break;
+            }
+        }
+    };
+    {
+        auto d = byID.find(dev->_id);
+        if (d == byID.end() || d->second != dev) return nullptr;
+        plist_t p_msg = plist_new_dict();
+        plist_dict_set_item(p_msg, "MessageType", plist_new_string("Detached"));
+        plist_dict_set_item(p_msg, "DeviceID", plist_new_uint(dev->_id));
+        change = log_change(getDeviceSubject(dev), Client::NOTIFY_DETACHED, p_msg);
+        byID.erase(d);
+        attachedMsgs.erase(dev->_id);
+    }
+    {
+        auto r = baseIDRefs.find(dev->_id >> 1);
+        if (r != baseIDRefs.end() && !--r->second) baseIDRefs.erase(r);
+    }
+    eraseDevice(bySerial(dev->_conntype), std::string(dev->_serial));
+    if (dev->_conntype == Device::MUXCONN_USB) {
+        USBDevice *usbdev = (USBDevice*)dev.get();
+        eraseDevice(usbByLocation, usbdev->usb_location());
+    }
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+    if (dev->_conntype == Device::MUXCONN_WIFI) {
+        WIFIDevice *wifidev = (WIFIDevice*)dev.get();
+        eraseDevice(wifiByMac, wifidev->_serviceName.substr(0,wifidev->_serviceName.find("@")));
+        for (auto &ip : wifidev->_ipaddr) {
+            eraseDevice(wifiByIP, ip);
+        }
+    }
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+    return change;
+}
+
+#pragma mark DeviceChange
+Muxer::DeviceChange::DeviceChange(uint64_t generation_, const ListenFilter::subject &subject_, int kind_, plist_t msg_)
+: generation(generation_), subject(subject_), kind(kind_), msg(msg_)
+{
+    bool didConstruct = false;
+    cleanup([&]{
+        if (!didConstruct) safeFreeCustom(msg, plist_free);
+    });
+    encoded = std::make_shared<EncodedPlist>(plist_copy(msg));
+    didConstruct = true;
+}
+
+Muxer::DeviceChange::~DeviceChange(){
+    safeFreeCustom(msg, plist_free);
+}
+
+#pragma mark ListenerTable
+void Muxer::ListenerTable::insert(std::shared_ptr<Client> cli, std::shared_ptr<const ListenFilter> filter){
+    if (filter && filter->serials().size()) {
+        for (auto &serial : filter->serials()) {
+            bySerial[serial].push_back({cli, filter});
+        }
+    } else {
+        any.push_back({cli, filter});
+    }
+}
+
+/*
+ returns false if cli wasn't listening
+ */
+bool Muxer::ListenerTable::erase(std::shared_ptr<Client> cli, const std::shared_ptr<const ListenFilter> &filter) noexcept{
+    bool didErase = false;
+    auto eraseFrom = [&](std::vector<listener> &vec){
+        for (auto c = vec.begin(); c != vec.end(); c++) {
+            if (c->cli == cli) {
+                vec.erase(c);
+                didErase = true;
+                break;
+            }
+        }
+    };
+    if (filter && filter->serials().size()) {
+        for (auto &serial : filter->serials()) {
+            auto l = bySerial.find(serial);
+            if (l == bySerial.end()) continue;
+            eraseFrom(l->second);
+            if (!l->second.size()) bySerial.erase(l);
+        }
+    } else {
+        eraseFrom(any);
+    }
+    return didErase;
 }
 
 #pragma mark Connection
 void Muxer::start_connect(int device_id, uint16_t dport, std::shared_ptr<Client> cli){
     std::shared_ptr<Device> dev;
     {
-        guardRead(_devicesGuard);
-        for (auto d : _devices) {
-            if (d->_id == device_id) {
-                dev = d;
-                goto found_device;
+        auto devices = _devices.read();
+        auto d = devices->byID.find(device_id);
+        retassure(d != devices->byID.end(), "start_connect(%d,%d,%d) failed",device_id,dport,cli->_fd);
+        dev = d->second;
+    }
+    dev->start_connect(dport, cli);
+}
+
+/*
+ The response is only rebuilt after the device list changed, in between it's served from cache
+ */
+void Muxer::send_deviceList(std::shared_ptr<Client> cli, uint32_t tag){
+    std::shared_ptr<EncodedPlist> list;
+    {
+        std::unique_lock<std::mutex> ul(_deviceListLck);
+        auto devices = _devices.read();
+        if (!_deviceList || _deviceListGeneration != devices->generation) {
+            plist_t p_rsp = NULL;
+            plist_t p_devarr = NULL;
+            cleanup([&]{
+                safeFreeCustom(p_rsp, plist_free);
+                safeFreeCustom(p_devarr, plist_free);
+            });
+            assure(p_rsp = plist_new_dict());
+            assure(p_devarr = plist_new_array());
+            for (auto &dev : devices->byID) {
+                plist_array_append_item(p_devarr, getDevicePlist(dev.second));
             }
+            plist_dict_set_item(p_rsp, "DeviceList", p_devarr); p_devarr = NULL; //transfer ownership
+            plist_dict_set_item(p_rsp, "Generation", plist_new_uint(devices->generation));
+            _deviceList = std::make_shared<EncodedPlist>(p_rsp); p_rsp = NULL; //transfer ownership
+            _deviceListGeneration = devices->generation;
         }
-        reterror("start_connect(%d,%d,%d) failed",device_id,dport,cli->_fd);
-    found_device:;
-    }
-    try {
-        dev->start_connect(dport, cli);
-    } catch (...) {
-        throw;
+        list = _deviceList;
     }
-    return;
+    cli->enqueue_pkt(list->get(cli->_proto_version, tag));
 }
 
-void Muxer::send_deviceList(std::shared_ptr<Client> cli, uint32_t tag){
+/*
+ Answers with the changes after generation, clients which fell too far behind get the full device list instead
+ */
+void Muxer::send_deviceListSince(std::shared_ptr<Client> cli, uint32_t tag, uint64_t generation){
     plist_t p_rsp = NULL;
-    plist_t p_devarr = NULL;
+    plist_t p_chgarr = NULL;
     cleanup([&]{
         safeFreeCustom(p_rsp, plist_free);
-        safeFreeCustom(p_devarr, plist_free);
+        safeFreeCustom(p_chgarr, plist_free);
     });
-    assure(p_rsp = plist_new_dict());
-    assure(p_devarr = plist_new_array());
     {
-        guardRead(_devicesGuard);
-        for (auto &dev : _devices) {
-            plist_array_append_item(p_devarr, getDevicePlist(dev));
+        auto devices = _devices.read();
+        if (!devices->covers(generation)) goto send_full_list;
+        assure(p_rsp = plist_new_dict());
+        assure(p_chgarr = plist_new_array());
+        for (auto &c : devices->changes) {
+            if (c->generation > generation) plist_array_append_item(p_chgarr, plist_copy(c->msg));
         }
+        plist_dict_set_item(p_rsp, "Generation", plist_new_uint(devices->generation));
     }
-    plist_dict_set_item(p_rsp, "DeviceList", p_devarr); p_devarr = NULL; //transfer ownership
-
+    plist_dict_set_item(p_rsp, "Changes", p_chgarr); p_chgarr = NULL; //transfer ownership
     cli->send_plist_pkt(tag, p_rsp);
+    return;
+
+send_full_list:
+    debug("ListDevicesSince(%llu) from client %d is out of range, sending full list",(unsigned long long)generation,cli->_fd);
+    send_deviceList(cli, tag);
 }
 
 void Muxer::send_listenerList(std::shared_ptr<Client> cli, uint32_t tag){
@@ -355,8 +550,8 @@ void Muxer::send_listenerList(std::shared_ptr<Client> cli, uint32_t tag){
 
 
     {
-        guardRead(_clientsGuard);
-        for (auto &c : _clients) {
+        auto clients = _clients.read();
+        for (auto &c : *clients) {
             plist_array_append_item(p_cliarr, getClientPlist(c));
         }
     }
@@ -366,30 +561,49 @@ void Muxer::send_listenerList(std::shared_ptr<Client> cli, uint32_t tag){
 }
 
 #pragma mark Notification
+/*
+ queues msg for every listener whose filter matches, slow listeners don't hold up the others.
+ Listeners which only follow other serials are never looked at.
+ */
+void Muxer::notify_listeners(EncodedPlist &msg, const ListenFilter::subject &subject, int kind) noexcept{
+    auto listeners = _listeners.read();
+    auto notify = [&](const ListenerTable::listener &l){
+        if (l.filter && !l.filter->matches(subject, kind)) return;
+        try {
+            l.cli->enqueue_pkt(msg.get(l.cli->_proto_version), subject.deviceID, (Client::notify_kind)kind);
+        } catch (...) {
+            //we don't care if this fails
+        }
+    };
+    for (auto &l : listeners->any) notify(l);
+    {
+        auto s = listeners->bySerial.find(subject.serial);
+        if (s != listeners->bySerial.end()) {
+            for (auto &l : s->second) notify(l);
+        }
+    }
+}
+
 void Muxer::notify_device_add(std::shared_ptr<Device> dev) noexcept{
     debug("notify_device_add(%d)",dev->_id);
-    plist_t p_rsp = NULL;
-    cleanup([&]{
-        safeFreeCustom(p_rsp, plist_free);
-    });
-
-    p_rsp = getDevicePlist(dev);
-
+    std::shared_ptr<EncodedPlist> msg;
     {
-        guardRead(_clientsGuard);
-        for (auto &c : _clients){
-            if (c->_isListening) {
-                try {
-                    c->send_plist_pkt(0, p_rsp);
-                } catch (...) {
-                    //we don't care if this fails
-                }
-            }
+        auto devices = _devices.read();
+        auto m = devices->attachedMsgs.find(dev->_id);
+        if (m != devices->attachedMsgs.end()) msg = m->second;
+    }
+    try {
+        if (!msg) {
+            //device is gone already, but its listeners might not know it was there
+            msg = std::make_shared<EncodedPlist>(getDevicePlist(dev));
         }
+        notify_listeners(*msg, getDeviceSubject(dev), Client::NOTIFY_ATTACHED);
+    } catch (...) {
+        error("Failed to notify listeners about device %d", dev->_id);
     }
 }
 
-void Muxer::notify_device_remove(int deviceID) noexcept{
+void Muxer::notify_device_remove(std::shared_ptr<Device> dev) noexcept{
     plist_t p_rsp = NULL;
     cleanup([&]{
         safeFreeCustom(p_rsp, plist_free);
@@ -397,19 +611,13 @@ void Muxer::notify_device_remove(int deviceID) noexcept{
     
     p_rsp = plist_new_dict();
     plist_dict_set_item(p_rsp, "MessageType", plist_new_string("Detached"));
-    plist_dict_set_item(p_rsp, "DeviceID", plist_new_uint(deviceID));
-    
-    {
-        guardRead(_clientsGuard);
-        for (auto c : _clients){
-            if (c->_isListening) {
-                try {
-                    c->send_plist_pkt(0, p_rsp);
-                } catch (...) {
-                    //we don't care if this fails
-                }
-            }
-        }
+    plist_dict_set_item(p_rsp, "DeviceID", plist_new_uint(dev->_id));
+
+    try {
+        EncodedPlist msg(p_rsp); p_rsp = NULL; //transfer ownership
+        notify_listeners(msg, getDeviceSubject(dev), Client::NOTIFY_DETACHED);
+    } catch (...) {
+        error("Failed to notify listeners about removal of device %d", dev->_id);
     }
 }
 
@@ -419,21 +627,32 @@ void Muxer::notify_device_paired(int deviceID) noexcept{
         safeFreeCustom(p_rsp, plist_free);
     });
 
+    try {
+        std::shared_ptr<const DeviceChange> change;
+        _devices.update([&](DeviceTable &devices){
+            ListenFilter::subject subject{deviceID, Device::MUXCONN_UNAVAILABLE, {}, 0}; //unknown devices only reach unfiltered listeners
+            auto d = devices.byID.find(deviceID);
+            if (d != devices.byID.end()) subject = getDeviceSubject(d->second);
+            plist_t p_msg = plist_new_dict();
+            plist_dict_set_item(p_msg, "MessageType", plist_new_string("Paired"));
+            plist_dict_set_item(p_msg, "DeviceID", plist_new_uint(deviceID));
+            change = devices.log_change(subject, Client::NOTIFY_PAIRED, p_msg); //also invalidates cached device lists
+        });
+        notify_listeners(*change->encoded, change->subject, Client::NOTIFY_PAIRED);
+        return;
+    } catch (...) {
+        error("Failed to log pairing of device %d", deviceID);
+    }
+
     p_rsp = plist_new_dict();
     plist_dict_set_item(p_rsp, "MessageType", plist_new_string("Paired"));
     plist_dict_set_item(p_rsp, "DeviceID", plist_new_uint(deviceID));
 
-    {
-        guardRead(_clientsGuard);
-        for (auto c : _clients){
-            if (c->_isListening) {
-                try {
-                    c->send_plist_pkt(0, p_rsp);
-                } catch (...) {
-                    //we don't care if this fails
-                }
-            }
-        }
+    try {
+        EncodedPlist msg(p_rsp); p_rsp = NULL; //transfer ownership
+        notify_listeners(msg, {deviceID, Device::MUXCONN_UNAVAILABLE, {}, 0}, Client::NOTIFY_PAIRED);
+    } catch (...) {
+        //we don't care if this fails
     }
 }
 
@@ -445,15 +664,15 @@ void Muxer::notify_alldevices(std::shared_ptr<Client> cli) noexcept {
     }
     
     {
-        guardRead(_devicesGuard);
-        for (auto &d : _devices){
-            plist_t p_rsp = NULL;
-            cleanup([&]{
-                safeFreeCustom(p_rsp, plist_free);
-            });
-            p_rsp = getDevicePlist(d);
+        //Attached messages are encoded once per device and shared by every listener
+        auto devices = _devices.read();
+        for (auto &m : devices->attachedMsgs){
             try {
-                cli->send_plist_pkt(0, p_rsp);
+                if (cli->_listenFilter) {
+                    auto d = devices->byID.find(m.first);
+                    if (d == devices->byID.end() || !cli->_listenFilter->matches(getDeviceSubject(d->second), Client::NOTIFY_ATTACHED)) continue;
+                }
+                cli->enqueue_pkt(m.second->get(cli->_proto_version), m.first, Client::NOTIFY_ATTACHED);
             } catch (...) {
                 //we don't care if this fails
             }
@@ -461,6 +680,31 @@ void Muxer::notify_alldevices(std::shared_ptr<Client> cli) noexcept {
     }
 }
 
+/*
+ Replays only the changes a reconnecting listener missed.
+ returns false if they aren't logged anymore, the caller needs to fall back to notify_alldevices
+ */
+bool Muxer::notify_devices_since(std::shared_ptr<Client> cli, uint64_t generation) noexcept {
+    debug("notify_devices_since(%d,%llu)",cli->_fd,(unsigned long long)generation);
+    if (!cli->_isListening) {
+        error("notify_devices_since called on a client which is not listening");
+        return true;
+    }
+
+    auto devices = _devices.read();
+    if (!devices->covers(generation)) return false;
+    for (auto &c : devices->changes){
+        if (c->generation <= generation) continue;
+        if (cli->_listenFilter && !cli->_listenFilter->matches(c->subject, c->kind)) continue;
+        try {
+            cli->enqueue_pkt(c->encoded->get(cli->_proto_version), c->subject.deviceID, (Client::notify_kind)c->kind);
+        } catch (...) {
+            //we don't care if this fails
+        }
+    }
+    return true;
+}
+
 #pragma mark Static
 plist_t Muxer::getDevicePlist(std::shared_ptr<Device> dev) noexcept{
     plist_t p_devp = NULL;
@@ -533,6 +777,14 @@ plist_t Muxer::getDevicePlist(std::shared_ptr<Device> dev) noexcept{
     }
 }
 
+ListenFilter::subject Muxer::getDeviceSubject(std::shared_ptr<Device> dev){
+    ListenFilter::subject ret{dev->_id, dev->_conntype, dev->_serial, 0};
+    if (dev->_conntype == Device::MUXCONN_USB) {
+        ret.productID = std::static_pointer_cast<USBDevice>(dev)->getPid();
+    }
+    return ret;
+}
+
 plist_t Muxer::getClientPlist(std::shared_ptr<Client> cli) noexcept{
     plist_t p_ret = NULL;
     cleanup([&]{
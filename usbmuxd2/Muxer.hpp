@@ -11,16 +11,25 @@
 #include "Devices/Device.hpp"
 #include "Manager/DeviceManager.hpp"
 #include "sysconf/sysconf.hpp"
+#include "Snapshot.hpp"
+#include "EncodedPlist.hpp"
+#include "ListenFilter.hpp"
 
 #include <libgeneral/macros.h>
-#include <libgeneral/GuardAccess.hpp>
 #include <plist/plist.h>
 
+#include <deque>
 #include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "Manager/WIFIDeviceManager-direct.hpp"
 
+#define DEVICE_CHANGELOG_MAX 0x400
+
 class ClientManager;
+class TCPManager;
 class USBDeviceManager;
 class WIFIDeviceManager;
 class WIFIDeviceManager_direct;
@@ -34,14 +43,70 @@ class Muxer {
     ClientManager *_climgr;
     USBDeviceManager *_usbdevmgr;
     DeviceManager *_wifidevmgr;
+    TCPManager *_tcpmgr;
 
     bool _doPreflight;
     bool _allowHeartlessWifi;
-    int _newid;
-    std::set<std::shared_ptr<Device>> _devices;
-    tihmstar::GuardAccess _devicesGuard;
-    std::set<std::shared_ptr<Client>> _clients;
-    tihmstar::GuardAccess _clientsGuard;
+    /*
+        Attached/Detached/Paired message as it was sent to listeners, tagged with the generation it created.
+     */
+    struct DeviceChange{
+        uint64_t generation;
+        ListenFilter::subject subject;                                                 //device the change is about
+        int kind;                                                                      //Client::notify_kind
+        plist_t msg;                                                                   //owned, copied into ListDevicesSince responses
+        std::shared_ptr<EncodedPlist> encoded;                                         //the notification sent to listeners
+
+        DeviceChange(uint64_t generation_, const ListenFilter::subject &subject_, int kind_, plist_t msg_); //takes ownership of msg_
+        DeviceChange(const DeviceChange &) = delete;
+        ~DeviceChange();
+    };
+    /*
+        Device registry. USB and WiFi connections of the same device share the upper bits of their ID (see add_device).
+        Secondary indices are multimaps, a replugged device may be added before its old instance is gone.
+     */
+    struct DeviceTable{
+        int newid = 1;
+        uint64_t generation = 0;                                                       //bumped on every change of the device list
+        std::unordered_map<int, std::shared_ptr<Device>> byID;
+        std::unordered_multimap<uint32_t, std::shared_ptr<Device>> usbByLocation;
+        std::unordered_multimap<std::string, std::shared_ptr<Device>> usbBySerial;
+        std::unordered_multimap<std::string, std::shared_ptr<Device>> wifiBySerial;
+        std::unordered_multimap<std::string, std::shared_ptr<Device>> wifiByMac;
+        std::unordered_multimap<std::string, std::shared_ptr<Device>> wifiByIP;
+        std::unordered_map<int, unsigned> baseIDRefs;                                  //ID>>1 -> number of connections using it
+        std::unordered_map<int, std::shared_ptr<EncodedPlist>> attachedMsgs;           //by ID, Attached notification of the device
+        std::deque<std::shared_ptr<const DeviceChange>> changes;                       //the last DEVICE_CHANGELOG_MAX changes, oldest first
+
+        std::unordered_multimap<std::string, std::shared_ptr<Device>> &bySerial(Device::mux_conn_type type) noexcept;
+        const std::unordered_multimap<std::string, std::shared_ptr<Device>> &bySerial(Device::mux_conn_type type) const noexcept;
+        int alloc_baseid() noexcept;
+        std::shared_ptr<const DeviceChange> log_change(const ListenFilter::subject &subject, int kind, plist_t msg); //takes ownership of msg
+        bool covers(uint64_t since) const noexcept;
+        void insert(std::shared_ptr<Device> dev);
+        std::shared_ptr<const DeviceChange> erase(std::shared_ptr<Device> dev);
+    };
+    /*
+        Listening clients. Clients which only follow specific serials are only looked at for events of those devices.
+     */
+    struct ListenerTable{
+        struct listener{
+            std::shared_ptr<Client> cli;
+            std::shared_ptr<const ListenFilter> filter;                                //nullptr if cli gets every notification
+        };
+        std::vector<listener> any;                                                     //listeners without a serial filter
+        std::unordered_map<std::string, std::vector<listener>> bySerial;
+
+        void insert(std::shared_ptr<Client> cli, std::shared_ptr<const ListenFilter> filter);
+        bool erase(std::shared_ptr<Client> cli, const std::shared_ptr<const ListenFilter> &filter) noexcept;
+    };
+    //readers never block, they work on whatever version was current when they started
+    Snapshot<DeviceTable> _devices;
+    Snapshot<std::set<std::shared_ptr<Client>>> _clients;
+    Snapshot<ListenerTable> _listeners;
+    std::mutex _deviceListLck;
+    std::shared_ptr<EncodedPlist> _deviceList;                                         //encoded ListDevices response, guarded by _deviceListLck
+    uint64_t _deviceListGeneration;                                                    //generation _deviceList was built from, guarded by _deviceListLck
 public:
     Muxer(bool doPreflight = true, bool allowHeartlessWifi = false);
     ~Muxer();
@@ -50,12 +115,15 @@ public:
     void spawnClientManager();
     void spawnUSBDeviceManager();
     void spawnWIFIDeviceManager(const std::string &directIP = std::string());
+    void spawnTCPManager(unsigned workers = 0);
     bool hasDeviceManager() noexcept;
+    TCPManager *getTCPManager() noexcept;
 
 #pragma mark Clients
     void add_client(std::shared_ptr<Client> cli);
     void delete_client(int cli_fd) noexcept;
     void delete_client(std::shared_ptr<Client> cli) noexcept;
+    void add_listener(std::shared_ptr<Client> cli, std::shared_ptr<const ListenFilter> filter);
 
 #pragma mark Devices
     void add_device(std::shared_ptr<Device> dev, bool notify = true);
@@ -71,16 +139,20 @@ public:
 #pragma mark Connection
     void start_connect(int device_id, uint16_t dport, std::shared_ptr<Client> cli);
     void send_deviceList(std::shared_ptr<Client> cli, uint32_t tag);
+    void send_deviceListSince(std::shared_ptr<Client> cli, uint32_t tag, uint64_t generation);
     void send_listenerList(std::shared_ptr<Client> cli, uint32_t tag);
 
 #pragma mark Notification
+    void notify_listeners(EncodedPlist &msg, const ListenFilter::subject &subject, int kind) noexcept;
     void notify_device_add(std::shared_ptr<Device> dev) noexcept;
-    void notify_device_remove(int deviceID) noexcept;
+    void notify_device_remove(std::shared_ptr<Device> dev) noexcept;
     void notify_device_paired(int deviceID) noexcept;
     void notify_alldevices(std::shared_ptr<Client> cli) noexcept;
+    bool notify_devices_since(std::shared_ptr<Client> cli, uint64_t generation) noexcept;
 
 #pragma mark Static
     static plist_t getDevicePlist(std::shared_ptr<Device> dev) noexcept;
+    static ListenFilter::subject getDeviceSubject(std::shared_ptr<Device> dev);
     static plist_t getClientPlist(std::shared_ptr<Client> cli) noexcept;
 };
 
@@ -0,0 +1,150 @@
+//
+//  PlistRequest.cpp
+//  usbmuxd2
+//
+
+#include "PlistRequest.hpp"
+#include <string.h>
+
+#pragma mark helpers
+static void skip_ws(const char *&p, const char *end) noexcept{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+}
+
+template <size_t N>
+static bool consume(const char *&p, const char *end, const char (&lit)[N]) noexcept{
+    if ((size_t)(end-p) < N-1 || memcmp(p, lit, N-1)) return false;
+    p += N-1;
+    return true;
+}
+
+/*
+ reads character data up to closeTag, data which would need to be unescaped is refused
+ */
+template <size_t N>
+static bool read_text(const char *&p, const char *end, const char (&closeTag)[N], std::string_view &out) noexcept{
+    const char *start = p;
+    const char *lt = (const char *)memchr(p, '<', end-p);
+    if (!lt || memchr(p, '&', lt-p)) return false;
+    out = std::string_view(start, lt-start);
+    p = lt;
+    return consume(p, end, closeTag);
+}
+
+static bool read_uint(const char *&p, const char *end, uint64_t &out) noexcept{
+    uint64_t val = 0;
+    const char *start = 0;
+    skip_ws(p, end);
+    start = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (val > (UINT64_MAX - (*p - '0')) / 10) return false;
+        val = val*10 + (*p++ - '0');
+    }
+    if (p == start) return false;
+    skip_ws(p, end);
+    if (!consume(p, end, "</integer>")) return false;
+    out = val;
+    return true;
+}
+
+static PlistRequest::command command_for(std::string_view msg) noexcept{
+    if (msg == "Connect") return PlistRequest::COMMAND_CONNECT;
+    if (msg == "Listen") return PlistRequest::COMMAND_LISTEN;
+    if (msg == "ListDevices") return PlistRequest::COMMAND_LISTDEVICES;
+    if (msg == "ListDevicesSince") return PlistRequest::COMMAND_LISTDEVICESSINCE;
+    if (msg == "ReadBUID") return PlistRequest::COMMAND_READBUID;
+    if (msg == "ReadPairRecord") return PlistRequest::COMMAND_READPAIRRECORD;
+    return PlistRequest::COMMAND_OTHER;
+}
+
+#pragma mark PlistRequest
+PlistRequest::PlistRequest()
+: cmd(COMMAND_OTHER)
+{
+    //
+}
+
+bool PlistRequest::parse(const char *xml, size_t len) noexcept{
+    const char *p = xml;
+    const char *end = xml+len;
+
+    //libplist stops at a terminating NUL too
+    if (const char *nul = (const char *)memchr(p, '\0', len)) end = nul;
+
+    //prolog: XML declaration and DOCTYPE
+    while (true) {
+        skip_ws(p, end);
+        if (consume(p, end, "<?")) {
+            const char *e = (const char *)memmem(p, end-p, "?>", 2);
+            if (!e) return false;
+            p = e+2;
+        } else if (consume(p, end, "<!--")) {
+            return false;
+        } else if (consume(p, end, "<!")) {
+            const char *e = (const char *)memchr(p, '>', end-p);
+            if (!e) return false;
+            p = e+1;
+        } else {
+            break;
+        }
+    }
+    if (!consume(p, end, "<plist")) return false;
+    {
+        const char *e = (const char *)memchr(p, '>', end-p);
+        if (!e || e[-1] == '/') return false;
+        p = e+1;
+    }
+    skip_ws(p, end);
+    if (!consume(p, end, "<dict>")) return false;
+
+    while (true) {
+        std::string_view key;
+        std::string_view str;
+        uint64_t num = 0;
+        enum {VAL_STRING, VAL_UINT, VAL_BOOL} type;
+
+        skip_ws(p, end);
+        if (consume(p, end, "</dict>")) break;
+        if (!consume(p, end, "<key>") || !read_text(p, end, "</key>", key)) return false;
+
+        skip_ws(p, end);
+        if (consume(p, end, "<string>")) {
+            if (!read_text(p, end, "</string>", str)) return false;
+            type = VAL_STRING;
+        } else if (consume(p, end, "<string/>")) {
+            type = VAL_STRING;
+        } else if (consume(p, end, "<integer>")) {
+            if (!read_uint(p, end, num)) return false;
+            type = VAL_UINT;
+        } else if (consume(p, end, "<true/>") || consume(p, end, "<false/>")) {
+            type = VAL_BOOL;
+        } else {
+            return false; //containers, data, dates, ... are left to libplist
+        }
+
+        auto setString = [&](field<std::string_view> &f){
+            f.present = (type == VAL_STRING);
+            f.val = str;
+        };
+        auto setUint = [&](field<uint64_t> &f){
+            f.present = (type == VAL_UINT);
+            f.val = num;
+        };
+        if (key == "MessageType") setString(messageType);
+        else if (key == "ClientVersionString") setString(clientVersionString);
+        else if (key == "BundleID") setString(bundleID);
+        else if (key == "ProgName") setString(progName);
+        else if (key == "PairRecordID") setString(pairRecordID);
+        else if (key == "kLibUSBMuxVersion") setUint(kLibUSBMuxVersion);
+        else if (key == "DeviceID") setUint(deviceID);
+        else if (key == "PortNumber") setUint(portNumber);
+        else if (key == "Generation") setUint(generation);
+        //other keys are irrelevant for the requests handled here
+    }
+    skip_ws(p, end);
+    if (!consume(p, end, "</plist>")) return false;
+
+    if (!messageType.present) return false;
+    cmd = command_for(messageType.val);
+    return true;
+}
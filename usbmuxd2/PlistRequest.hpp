@@ -0,0 +1,57 @@
+//
+//  PlistRequest.hpp
+//  usbmuxd2
+//
+
+#ifndef PlistRequest_hpp
+#define PlistRequest_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string_view>
+
+/*
+ Decoder for the small, flat XML plists clients send for the frequent requests.
+ Keys are picked up while scanning the document, no plist DOM is built.
+ Extracted strings point into the scanned buffer and are only valid as long as it is.
+
+ Anything outside the fixed vocabulary (nested containers, data, XML entities, ...)
+ makes parse() fail, the caller then falls back to libplist.
+ */
+class PlistRequest {
+public:
+    enum command {
+        COMMAND_OTHER = 0,  //needs the full plist
+        COMMAND_LISTEN,
+        COMMAND_CONNECT,
+        COMMAND_LISTDEVICES,
+        COMMAND_LISTDEVICESSINCE,
+        COMMAND_READBUID,
+        COMMAND_READPAIRRECORD
+    };
+    template <typename T>
+    struct field{
+        bool present = false;   //only set if the value had the expected type
+        T val{};
+    };
+
+    command cmd;
+    field<std::string_view> messageType;
+    field<std::string_view> clientVersionString;
+    field<std::string_view> bundleID;
+    field<std::string_view> progName;
+    field<std::string_view> pairRecordID;
+    field<uint64_t> kLibUSBMuxVersion;
+    field<uint64_t> deviceID;
+    field<uint64_t> portNumber;
+    field<uint64_t> generation;
+
+    PlistRequest();
+
+    /*
+     returns false if the document can't be handled without libplist
+     */
+    bool parse(const char *xml, size_t len) noexcept;
+};
+
+#endif /* PlistRequest_hpp */
@@ -0,0 +1,57 @@
+//
+//  Snapshot.hpp
+//  usbmuxd2
+//
+
+#ifndef Snapshot_hpp
+#define Snapshot_hpp
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+/*
+ Copy-on-write container for tables which are read much more often than they change.
+ Readers grab the current version without ever blocking and keep it alive for as long as they hold it.
+ Writers are serialized, modify a private copy and publish it atomically.
+ A version is freed once its last reader dropped it.
+ */
+template <typename T>
+class Snapshot {
+#ifdef __cpp_lib_atomic_shared_ptr
+    std::atomic<std::shared_ptr<const T>> _cur;
+#else
+    std::shared_ptr<const T> _cur; //only accessed through std::atomic_load/std::atomic_store
+#endif
+    std::mutex _writeLck;
+
+public:
+    Snapshot() : _cur(std::make_shared<const T>()) {}
+    Snapshot(const Snapshot &) = delete;
+
+    std::shared_ptr<const T> read() const noexcept{
+#ifdef __cpp_lib_atomic_shared_ptr
+        return _cur.load(std::memory_order_acquire);
+#else
+        return std::atomic_load_explicit(&_cur, std::memory_order_acquire);
+#endif
+    }
+
+    /*
+     calls fn with a modifiable copy of the current version, which gets published once fn returns.
+     If fn throws, nothing is published.
+     */
+    template <typename Func>
+    void update(Func fn){
+        std::unique_lock<std::mutex> ul(_writeLck);
+        std::shared_ptr<T> next = std::make_shared<T>(*read());
+        fn(*next);
+#ifdef __cpp_lib_atomic_shared_ptr
+        _cur.store(std::move(next), std::memory_order_release);
+#else
+        std::atomic_store_explicit(&_cur, std::shared_ptr<const T>(std::move(next)), std::memory_order_release);
+#endif
+    }
+};
+
+#endif /* Snapshot_hpp */
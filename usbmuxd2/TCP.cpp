@@ -17,84 +17,21 @@
 #define MIN(a,b) ((a) > (b) ? (b) : (a))
 #define unacked ((uint64_t)((_stx.seq >= _stx.seqAcked) ? (_stx.seq - _stx.seqAcked) : ((uint32_t)(0x100000000ULL + _stx.seq - _stx.seqAcked))))
 
-TCP::TCP(uint16_t sPort, uint16_t dPort, std::shared_ptr<USBDevice> dev, std::shared_ptr<Client> cli)
-: _connState(CONN_CONNECTING), _stx{0,0,0,0,0,0x80000},
- _sPort(sPort), _dPort(dPort), _dev(dev), _cli(cli), _payloadBuf(NULL), _pfd{.fd = -1, .events=POLLIN}
+TCP::TCP(uint16_t sPort, uint16_t dPort, std::shared_ptr<USBDevice> dev, std::shared_ptr<Client> cli, TCPManager *mgr)
+: _connState(CONN_CONNECTING), _stx{0,0,0,0,0,TCP::bufsize,TCP::bufsize},
+ _sPort(sPort), _dPort(dPort), _dev(dev), _cli(cli)
+, _selfref{}, _mgr(mgr), _mgrToken(0)
+, _payloadBuf(NULL), _payloadBufStart(0), _payloadBufLen(0), _payloadBufDirty(0)
+, _fd(-1), _clientHup(false), _clientClosed(false), _handoverPending(false)
 {
     debug("[TCP] (%d) creating connection for sport=%u",cli->_fd,_sPort);
-    assure(_payloadBuf = (char*)malloc(TCP::bufsize));
-    
     _stx.seqAcked = _stx.seq = (uint32_t)random();
 }
 
 TCP::~TCP(){
     debug("destroying TCP %p",this);
-    stopLoop();
-    safeFree(_payloadBuf);
-    safeClose(_pfd.fd);
-}
-
-bool TCP::loopEvent(){
-    int err = 0;
-    bool remoteDidClose = false;
-    ssize_t cnt = 0;
-
-    uint32_t lseqAck = 0;
-    uint32_t lseq = 0;
-    char *bufstart = NULL;
-    size_t maxRCV = 0;
-    
-    {
-        std::unique_lock<std::mutex> ul(_lockStx);
-        lseqAck = ((uint64_t)_stx.seqAcked + TCP::bufsize)%TCP::bufsize;
-        lseq = ((uint64_t)_stx.seq + TCP::bufsize)%TCP::bufsize;
-    }
-    bufstart = _payloadBuf+lseq;
-    maxRCV = (lseq >= lseqAck) ? (TCP::bufsize - lseq) : lseqAck-lseq;
-    
-    retassure(_pfd.fd != -1, "[TCP CLIENT] bad pollfd");
-    retassure((err = poll(&_pfd,1,-1)) != -1, "[TCP CLIENT] poll failed");
-    if (_pfd.revents & POLLHUP){
-        remoteDidClose = true;
-        debug("[TCP CLIENT] Remote connection closed");
-    }
-    
-    if ((_pfd.revents & (~(POLLIN | POLLHUP))) != 0){
-      kill(__LINE__);
-      reterror("[TCP CLIENT] (fd=%d) unexpected poll revent=0x%x",_pfd.fd,_pfd.revents);
-    }else if (!(_pfd.revents & POLLIN)){
-      warning("[TCP CLIENT] poll returned, but no data to read");
-      return true;
-    }
-    
-    do{
-        if ((cnt = recv(_pfd.fd, bufstart, maxRCV, MSG_DONTWAIT))<0){
-            kill(__LINE__);
-            reterror("[TCP CLIENT] recv failed on client %d with error=%d (%s)",_pfd.fd,errno,strerror(errno));
-        }
-        
-        if (cnt == 0) break;
-        
-        debug("[TCP CLIENT] got packet of size %zd",cnt);
-
-        while (cnt>0) {
-            ssize_t doSend = MIN(cnt,TCP::TCP_MTU);
-            size_t didSend = send_data(bufstart,doSend);
-            bufstart += didSend;
-            cnt -= didSend;
-        }
-    }while (remoteDidClose);
-    
-    if (remoteDidClose) {
-        send_fin();
-        return false;
-    }
-    
-    return true;
-}
-
-void TCP::stopAction() noexcept{
-    if (_pfd.fd != -1) shutdown(_pfd.fd, SHUT_RDWR);
+    safeDelete(_payloadBuf);
+    safeClose(_fd);
 }
 
 void TCP::send_tcp(std::uint8_t flags) {
@@ -114,6 +51,7 @@ void TCP::send_tcp(std::uint8_t flags) {
           _sPort, _dPort, _stx.seq, _stx.ack, flags, 0);
     // Update TCP states
     _stx.acked = _stx.ack;
+    _stx.winSent = _stx.win;
     _dev->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
 }
 
@@ -134,12 +72,32 @@ void TCP::send_ack_nolock(){
 
         // Update TCP states
         _stx.acked = _stx.ack;
+        _stx.winSent = _stx.win;
     }
     if (doSend) {
         _dev->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
     }
 }
 
+void TCP::send_window_update_nolock(){
+    tcphdr tcp_header{};
+    debug("Sending tcp window update: sport=%u dport=%u seq=%u ack=%u window=%u",
+          _sPort, _dPort, _stx.seq, _stx.ack, _stx.win);
+
+    tcp_header.th_sport = htons(_sPort);
+    tcp_header.th_dport = htons(_dPort);
+    tcp_header.th_seq = htonl(_stx.seq);
+    tcp_header.th_ack = htonl(_stx.ack);
+    tcp_header.th_flags = TH_ACK;
+    tcp_header.th_off = sizeof(tcphdr) / 4;
+    tcp_header.th_win = htons(static_cast<std::uint16_t>(_stx.win >> 8));
+
+    // Update TCP states
+    _stx.acked = _stx.ack;
+    _stx.winSent = _stx.win;
+    _dev->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
+}
+
 void TCP::send_rst_nolock(){
     tcphdr tcp_header{};
     debug("Sending tcp rst packet: sport=%u dport=%u seq=%u ack=%u flags=0x%x",
@@ -179,47 +137,23 @@ void TCP::send_fin(){
     _dev->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
 }
 
-size_t TCP::send_data(void *buf, size_t buflen){
-    size_t len = buflen;
-    if (!len) return 0;
+/*
+ returns the number of bytes which may be sent in the next packet (0 if the device window is full)
+ */
+size_t TCP::send_window_nolock(){
+    int64_t rembytes = (int64_t)_stx.inWin - unacked;
+    if (rembytes <= 0) return 0;
+    return (rembytes > TCP_MTU) ? TCP_MTU : (size_t)rembytes;
+}
+
+/*
+ txbuf comes from USBDevice::tx_buffer_get() with len bytes of payload placed behind the headers.
+ The caller reserved TX descriptors with USBDevice::tx_reserve(), txbuf and the reservation are consumed in any case.
+ */
+void TCP::send_data(unsigned char *txbuf, size_t len){
     tcphdr tcp_header{};
-    int64_t rembytes = 0;
-    int sendfails = 0;
-
-    constexpr const int Fastpath_Retry_CNT = 1;
-    
-retry:
-    for (int i=0; i<Fastpath_Retry_CNT; i++) {
-        _lockStx.lock();
-        if (unacked + len > _stx.inWin) {
-            _lockStx.unlock();
-            sched_yield();
-        }else{
-            goto cnt_label; //fast path
-        }
-    }
-    _lockStx.lock();
-    //slow path
-    rembytes = (int64_t)_stx.inWin - unacked;
-    if (rembytes<=0) {
-        //at this point we *have to* wait for an ACK
-        //no smaller payload is possible
-        ++sendfails;
-        debug("[%d] we have to wait for ACK before sending more data!",sendfails);
-        
-        // **** Put this thread to sleep until we can send more data **** //
-        uint64_t wevent = _canSendEvent.getNextEvent();
-        _lockStx.unlock(); //unlocking _lockStx inbetween _canSendEvent locks, makes sure we never lock if we could send data!
-
-        _canSendEvent.waitForEvent(wevent);//this lock will always be "blocking", unless we can send more data
-        assure(_connState == CONN_CONNECTED);
-
-        goto retry;
-    }
-    len = rembytes > buflen ? buflen : rembytes;
-cnt_label:
-    if (len > TCP_MTU) len = TCP_MTU;
-    
+    std::unique_lock<std::mutex> ul(_lockStx);
+
     tcp_header.th_sport = htons(_sPort);
     tcp_header.th_dport = htons(_dPort);
     tcp_header.th_seq = htonl(_stx.seq);
@@ -230,46 +164,124 @@ cnt_label:
 
     // Update TCP states
     _stx.acked = _stx.ack;
+    _stx.winSent = _stx.win;
     _stx.seq += len;
     debug("Sending tcp payload packet: sport=%u dport=%u seq=%u seqAcked=%u ack=%u flags=0x%x len=%zu rwindow=%u[%u] unacked=%lu",
           htons(tcp_header.th_sport), htons(tcp_header.th_dport), htonl(tcp_header.th_seq), _stx.seqAcked, htonl(tcp_header.th_ack),
           TH_ACK, len, _stx.inWin, _stx.inWin >> 8, (unsigned long)unacked);
 
-    _dev->send_packet(USBDevice::MUX_PROTO_TCP, buf, len, &tcp_header);
-    _lockStx.unlock();
-    return len;
+    _dev->send_packet_inplace(USBDevice::MUX_PROTO_TCP, txbuf, len, &tcp_header, true);
 }
 
-void TCP::flush_data(){
-    uint32_t lseqAck = 0;
-    uint32_t lseq = 0;
-    char *bufstart = NULL;
-    size_t buflen = 0;
-    tcphdr tcp_header{};
+/*
+ Reads from the client as long as the device window allows.
+ Client data is received directly behind the (reserved) mux and TCP headers
+ of a USB transfer buffer, which is then submitted to the device as is.
+ returns true if the client closed the connection
+ */
+bool TCP::forward_client_data(){
+    unsigned char *txbuf = NULL;
+    cleanup([&]{
+        _dev->tx_buffer_put(txbuf);
+    });
+    ssize_t cnt = 0;
+    size_t maxRCV = 0;
+    size_t payloadOffset = 0;
 
-    std::unique_lock<std::mutex> ul(_lockStx);
+    payloadOffset = _dev->mux_header_size() + sizeof(tcphdr);
 
-    lseqAck = ((uint64_t)_stx.seqAcked + TCP::bufsize)%TCP::bufsize;
-    lseq = ((uint64_t)_stx.seq + TCP::bufsize)%TCP::bufsize;
-    bufstart = _payloadBuf+lseqAck;
-    buflen = (lseq >= lseqAck) ? lseq-lseqAck : (TCP::bufsize - lseqAck);
-    
-    if (buflen > TCP_MTU) buflen = TCP_MTU;
-    if (!buflen) return;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> ul(_lockStx);
+            maxRCV = send_window_nolock();
+        }
+        if (!maxRCV) {
+            debug("we have to wait for ACK before sending more data!");
+            break;
+        }
+        if (!txbuf) txbuf = _dev->tx_buffer_get();
 
-    tcp_header.th_sport = htons(_sPort);
-    tcp_header.th_dport = htons(_dPort);
-    tcp_header.th_seq = htonl(_stx.seqAcked);
-    tcp_header.th_ack = htonl(_stx.ack);
-    tcp_header.th_flags = TH_ACK | TH_FIN;
-    tcp_header.th_off = sizeof(tcphdr) / 4;
-    tcp_header.th_win = htons(static_cast<std::uint16_t>(_stx.win >> 8));
+        if ((cnt = recv(_fd, txbuf + payloadOffset, maxRCV, MSG_DONTWAIT))<0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break; //socket drained
+            kill(__LINE__);
+            reterror("[TCP CLIENT] recv failed on client %d with error=%d (%s)",_fd,errno,strerror(errno));
+        }
 
-    debug("Flushing tcp packet: sport=%u dport=%u seq=%u seqAcked=%u ack=%u flags=0x%x len=%zu rwindow=%u[%u]",
-          htons(tcp_header.th_sport), htons(tcp_header.th_dport), htonl(tcp_header.th_seq), _stx.seqAcked, htonl(tcp_header.th_ack),
-          tcp_header.th_flags, buflen, _stx.inWin, _stx.inWin >> 8);
+        if (cnt == 0) return true;
+
+        debug("[TCP CLIENT] got packet of size %zd",cnt);
+        //wait for the bus before taking _lockStx, RX needs it to process ACKs
+        retassure(_dev->tx_reserve(), "[TCP CLIENT] device went away while sending data of client %d",_fd);
+        {
+            unsigned char *sendbuf = txbuf; txbuf = NULL; //consumed by send_data
+            send_data(sendbuf, cnt);
+        }
+    }
+    return false;
+}
+
+/*
+ Writes buffered device data to the client without blocking
+ and reopens the receive window towards the device accordingly.
+ */
+void TCP::flush_client_nolock(){
+    ssize_t didSend = 0;
+
+    if (_fd == -1) return;
+
+    while (_payloadBufLen) {
+        //the ring is mirrored, so whatever is buffered is contiguous
+        if ((didSend = send(_fd, _payloadBuf->at(_payloadBufStart), _payloadBufLen, MSG_DONTWAIT)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            //client died, but don't throw, since it wasn't the devices fault!
+            //terminate TCP instead
+            error("Failed to send payload to client with payload_len=%u errno=%d (%s)",_payloadBufLen,errno,strerror(errno));
+            kill(__LINE__);
+            return;
+        }
+        _payloadBufStart = (uint32_t)((_payloadBufStart + didSend) % TCP::bufsize);
+        _payloadBufLen -= (uint32_t)didSend;
+    }
+    if (!_payloadBufLen) {
+        _payloadBufStart = 0;
+        if (_payloadBufDirty > TCP::bufkeep) {
+            //client caught up after a burst, only keep the start of the ring committed
+            _payloadBuf->release(TCP::bufkeep, _payloadBufDirty - TCP::bufkeep);
+            _payloadBufDirty = TCP::bufkeep;
+        }
+    }
+    _stx.win = TCP::bufsize - _payloadBufLen;
+
+    /*
+        The device only sends as much as the window we last advertised,
+        so tell it once a significant part of the window opened up again.
+     */
+    if (_connState == CONN_CONNECTED && _stx.win > _stx.winSent
+        && (_stx.win - _stx.winSent >= TCP::bufsize/4 || !_payloadBufLen)) {
+        send_window_update_nolock();
+    }
+}
+
+/*
+ Only read from the client while the device has window left,
+ and only wait for writability while we have data for the client.
+ */
+uint32_t TCP::client_interest_nolock(){
+    uint32_t interest = TCPManager::CLIENT_EVENT_NONE;
+    if (!_clientClosed && send_window_nolock()) interest |= TCPManager::CLIENT_EVENT_READ;
+    if (_payloadBufLen) interest |= TCPManager::CLIENT_EVENT_WRITE;
+    return interest;
+}
 
-    _dev->send_packet(USBDevice::MUX_PROTO_TCP, bufstart, buflen, &tcp_header);
+void TCP::rearm_nolock(){
+    uint32_t interest = 0;
+    if (!_mgrToken) return; //not (or no longer) handed to TCPManager
+    interest = client_interest_nolock();
+    if (!interest && (_clientHup || _clientClosed)) {
+        //nothing to do, don't let a pending hangup fire over and over again
+        return;
+    }
+    _mgr->rearm_connection(_mgrToken, _fd, interest);
 }
 
 #pragma mark public
@@ -286,19 +298,19 @@ void TCP::kill(int reason) noexcept{
 void TCP::deconstruct() noexcept{
     {
         std::unique_lock<std::mutex> ul(_lockStx);
+        finish_connect_nolock(false); //no-op unless the device never answered our SYN
         _connState = CONN_DYING;
-        _connStateDidChange.notifyAll();
-        _canSendEvent.notifyAll();
-    }
-    {
-        std::unique_lock<std::mutex> ul(_lockClientSend);
-        _canClientSendEvent.notifyAll();
+        if (_mgrToken) {
+            _mgr->remove_connection(_mgrToken, _fd);
+            _mgrToken = 0;
+        }
     }
 }
 
 void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_len){
     uint32_t rSeq = 0;
     uint32_t rAck = 0;
+    bool doRearm = false;
     {
         std::unique_lock<std::mutex> ul(_lockStx);
         debug("[TCP IN] sport=%u dport=%u seq=%u ack=%u flags=0x%x window=%u[%u] len=%u",
@@ -314,39 +326,94 @@ void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_le
                 _stx.seq++;
                 _stx.ack = rSeq+1; //just copy this on first packet without parsing
                 _stx.inWin = ntohs(tcp_header->th_win) << 8;
-                _stx.pktForwarded = _stx.ack;
                 
                 send_ack_nolock();
                 _connState = CONN_CONNECTED;
-                _connStateDidChange.notifyAll();
+                info("TCP Connected to device");
+                finish_connect_nolock(true);
             } else {
                 retassure(tcp_header->th_flags & TH_RST, "Received unexpected data while connecting");
                 _connState = CONN_REFUSED;
-                _connStateDidChange.notifyAll();
                 info("Connection refused by device");
+                finish_connect_nolock(false);
                 kill(__LINE__);
             }
         } else if (_connState == CONN_CONNECTED) {
             if (tcp_header->th_flags == TH_ACK) {
-                while (_stx.ack != rSeq) {
-                    uint64_t wevent = _canSendEvent.getNextEvent();
-                    ul.unlock();
-                    _canSendEvent.waitForEvent(wevent);
-                    if (_connState != CONN_CONNECTED) return;
-                    ul.lock();
+                bool wasWindowClosed = false;
+                if (_stx.ack != rSeq) {
+                    //USBDevice delivers mux packets in order, so the device skipped data
+                    error("Unexpected TCP seq=%u on sport=%u (expected %u)",rSeq,_sPort,_stx.ack);
+                    kill(__LINE__);
+                    return;
                 }
-                
+
+                wasWindowClosed = !send_window_nolock();
                 _stx.inWin = ntohs(tcp_header->th_win) << 8;
                 _stx.seqAcked = rAck; //update ACK on sent packets
+                if (wasWindowClosed && send_window_nolock()) {
+                    //client reader is parked until the device window opens up again
+                    doRearm = true;
+                }
+
+                if (payload_len) {
+                    uint32_t didForward = 0;
+                    if (payload_len > TCP::bufsize - _payloadBufLen) {
+                        error("Device overran receive window on sport=%u dport=%u (len=%u window=%u)",_sPort,_dPort,payload_len,TCP::bufsize - _payloadBufLen);
+                        kill(__LINE__);
+                        return;
+                    }
+                    if (!_payloadBufLen && _fd != -1) {
+                        //fast path: forward to client without buffering
+                        ssize_t didSend = send(_fd, payload, payload_len, MSG_DONTWAIT);
+                        if (didSend < 0) {
+                            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                //client died, but don't throw, since it wasn't the devices fault!
+                                //terminate TCP instead
+                                error("Failed to send payload to client with payload_len=%u errno=%d (%s)",payload_len,errno,strerror(errno));
+                                kill(__LINE__);
+                                return;
+                            }
+                            didSend = 0;
+                        }
+                        didForward = (uint32_t)didSend;
+                    }
+                    if (didForward < payload_len) {
+                        //client is slow, keep the rest and let the loop deliver it once the client is writable
+                        uint32_t remaining = payload_len - didForward;
+                        uint32_t wpos = (_payloadBufStart + _payloadBufLen) % TCP::bufsize;
+                        if (!_payloadBuf) {
+                            try {
+                                _payloadBuf = new MirrorRing(TCP::bufsize);
+                            } catch (tihmstar::exception &e) {
+                                error("Failed to allocate payload buffer on sport=%u error=%d (%s)",_sPort,e.code(),e.what());
+                                kill(__LINE__);
+                                return;
+                            }
+                        }
+                        memcpy(_payloadBuf->at(wpos), payload + didForward, remaining);
+                        _payloadBufLen += remaining;
+                        if (wpos + remaining > _payloadBufDirty) {
+                            _payloadBufDirty = MIN(wpos + remaining, (uint32_t)TCP::bufsize);
+                        }
+                        doRearm = true;
+                    }
+                    //shrink advertised window by whatever the client didn't take yet
+                    _stx.win = TCP::bufsize - _payloadBufLen;
+                }
                 _stx.ack += payload_len;
-                if (payload_len && !_canSendEvent.members()){
-                    /*
-                        We can avoid sending ACK here if we're gonna send data in next packet anyways
-                     */
+                if (payload_len) {
                     send_ack_nolock();
                 }
                 
-                _canSendEvent.notifyAll();
+                if (doRearm) {
+                    try {
+                        rearm_nolock();
+                    } catch (tihmstar::exception &e) {
+                        error("Failed to rearm client on sport=%u error=%d (%s)",_sPort,e.code(),e.what());
+                        kill(__LINE__);
+                    }
+                }
             } else if (tcp_header->th_flags == TH_RST){
                 info("Connection reset by device, flags: %u sport=%u dport=%u", tcp_header->th_flags,_sPort,_dPort);
                 kill(__LINE__);
@@ -368,48 +435,118 @@ void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_le
     #endif
         }
     }
-    
-    if (payload_len) {
-        std::unique_lock<std::mutex> ul(_lockClientSend);
-        while (rSeq != _stx.pktForwarded) {
-            uint64_t wevent = _canClientSendEvent.getNextEvent();
-            ul.unlock();
-            _canClientSendEvent.waitForEvent(wevent);
-            if (_connState != CONN_CONNECTED) return;
-            ul.lock();
+}
+
+/*
+ Sends the SYN and returns right away, the client stays parked until the device answers.
+ */
+void TCP::connect(){
+    info("Starting TCP connection clifd=%d",_cli->_fd);
+    try {
+        send_tcp(TH_SYN);
+    } catch (...) {
+        //caller reports the failure to the client
+        std::unique_lock<std::mutex> ul(_lockStx);
+        _cli = nullptr;
+        throw;
+    }
+}
+
+/*
+ Reports the outcome of the connect request to the parked client without blocking.
+ On success we take over the client socket once the client took its last messages,
+ otherwise the client goes back to command state.
+ */
+void TCP::finish_connect_nolock(bool success) noexcept{
+    if (!_cli) return;
+
+    if (!success) {
+        std::shared_ptr<Client> cli = std::move(_cli); //free client
+        if (_handoverPending) {
+            //client was told it's connected already, it can't go back to command state
+            _handoverPending = false;
+            cli->kill();
+        } else {
+            cli->connect_refused();
         }
-        if (_connState != CONN_CONNECTED) return;
-        //forward to client without buffering
-        ssize_t didSend = send(_pfd.fd, payload, payload_len, 0);
-        if(didSend != payload_len){
-            //client died, but don't throw, since it wasn't the devices fault!
-            //terminate TCP instead
-            error("Failed to send payload to client with didSend=%zd payload_len=%u errno=%d (%s)",didSend,payload_len,errno,strerror(errno));
-            kill(__LINE__);
+        return;
+    }
+
+    try {
+        _cli->send_result(_cli->_connectTag, RESULT_OK);
+        if (_cli->begin_handover(_selfref.lock())) {
+            //ClientManager calls complete_handover() once the result went out
+            _handoverPending = true;
+            return;
         }
-        _stx.pktForwarded += payload_len;
-        _canClientSendEvent.notifyAll();
+    } catch (tihmstar::exception &e) {
+        std::shared_ptr<Client> cli = std::move(_cli);
+        error("Failed to report connection to client %d error=%d (%s)",cli->_fd,e.code(),e.what());
+        cli->kill();
+        kill(__LINE__);
+        return;
     }
+    take_client_nolock();
 }
 
-void TCP::connect(){
-    cleanup([&]{
-        _cli = nullptr; //free client
-    });
+/*
+ From here on the client socket carries connection data only
+ */
+void TCP::take_client_nolock() noexcept{
+    std::shared_ptr<Client> cli = std::move(_cli); //free client
+    _handoverPending = false;
+
+    //device data which arrived in the meantime is buffered and delivered once the client is armed
+    _fd = cli->_fd; cli->_fd = -1; //disown client, we take care of this fd now
+    cli->kill(); //the client is done, only its socket lives on
+    try {
+        _mgrToken = _mgr->add_connection(_selfref.lock(), _fd, client_interest_nolock());
+    } catch (tihmstar::exception &e) {
+        error("Failed to hand client over to TCPManager error=%d (%s)",e.code(),e.what());
+        kill(__LINE__);
+    }
+}
 
-    info("Starting TCP connection clifd=%d",_pfd.fd);
+/*
+ Called by TCPManager whenever the client socket became ready.
+ The socket is disarmed while we're in here and gets rearmed with our current interest on the way out.
+ */
+void TCP::handle_client_events(uint32_t events){
+    bool remoteDidClose = false;
+    std::unique_lock<std::mutex> el(_eventLck);
+
+    if (events & (TCPManager::CLIENT_EVENT_WRITE | TCPManager::CLIENT_EVENT_HUP)) {
+        std::unique_lock<std::mutex> ul(_lockStx);
+        if (events & TCPManager::CLIENT_EVENT_HUP) _clientHup = true;
+        flush_client_nolock();
+    }
+
+    if (events & (TCPManager::CLIENT_EVENT_READ | TCPManager::CLIENT_EVENT_HUP)) {
+        remoteDidClose = forward_client_data();
+    }
+
+    if (remoteDidClose) {
+        debug("[TCP CLIENT] Remote connection closed");
+        {
+            std::unique_lock<std::mutex> ul(_lockStx);
+            _clientClosed = true;
+        }
+        send_fin();
+    }
 
     {
-        uint64_t wevent = _connStateDidChange.getNextEvent();
-        send_tcp(TH_SYN);
-        _connStateDidChange.waitForEvent(wevent);
-        retassure(_connState == CONN_CONNECTED, "Failed to establish TCP connection clifd=%d _connState=%d",_pfd.fd,_connState);
+        std::unique_lock<std::mutex> ul(_lockStx);
+        rearm_nolock();
     }
-    info("TCP Connected to device");
-    _cli->send_result(_cli->_connectTag, RESULT_OK);
+}
 
-    _pfd.fd = _cli->_fd; _cli->_fd = -1; //disown client, we take care of this fd now
-    startLoop();
+/*
+ Called by ClientManager once the client took the connect result, with the client disarmed
+ */
+void TCP::complete_handover() noexcept{
+    std::unique_lock<std::mutex> ul(_lockStx);
+    if (!_handoverPending) return; //connection died in the meantime
+    take_client_nolock();
 }
 
 #pragma mark static
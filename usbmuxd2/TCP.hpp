@@ -12,12 +12,12 @@
 #include <memory>
 #include "Devices/USBDevice.hpp"
 #include "Manager/USBDeviceManager.hpp"
-#include <libgeneral/Manager.hpp>
+#include "Manager/TCPManager.hpp"
+#include "MirrorRing.hpp"
 #include <mutex>
-#include <poll.h>
 
 class Client;
-class TCP : public tihmstar::Manager {
+class TCP {
     enum mux_conn_state {
         CONN_CONNECTING,        // SYN
         CONN_CONNECTED,         // SYN/SYNACK/ACK -> active
@@ -26,39 +26,50 @@ class TCP : public tihmstar::Manager {
     } _connState;
     struct TCPSenderState {
         uint32_t seq, seqAcked, ack, acked, inWin, win;//(TCP::bufsize >> 8)
-        uint32_t pktForwarded;
+        uint32_t winSent; //window we last told the device about
     } _stx;
     
     uint16_t _sPort;
     uint16_t _dPort;
     std::shared_ptr<USBDevice> _dev;
     std::shared_ptr<Client> _cli;
+    std::weak_ptr<TCP> _selfref;
+    TCPManager *_mgr; //not owned
+    uint64_t _mgrToken; //guarded by _lockStx
+    std::mutex _eventLck;
     std::mutex _lockStx;
-    std::mutex _lockClientSend;
-    tihmstar::Event _canSendEvent;
-    tihmstar::Event _connStateDidChange;
-    tihmstar::Event _canClientSendEvent;
 
-    char *_payloadBuf;
-    struct pollfd _pfd;
+    MirrorRing *_payloadBuf;    //device -> client data, which the client didn't take yet. Allocated once it's first needed
+    uint32_t _payloadBufStart;  //guarded by _lockStx
+    uint32_t _payloadBufLen;    //guarded by _lockStx
+    uint32_t _payloadBufDirty;  //end of the touched part of the ring, guarded by _lockStx
+    int _fd;
+    bool _clientHup;            //guarded by _lockStx
+    bool _clientClosed;         //guarded by _lockStx
+    bool _handoverPending;      //client was told about the connection but still holds its socket, guarded by _lockStx
 
 #pragma mark private
-    bool loopEvent() override;
-    void stopAction() noexcept override;
     void send_tcp(uint8_t flags);
     void send_ack_nolock();
     void send_rst_nolock();
     void send_rst();
     void send_fin();
-    size_t send_data(void *buf, size_t len);
-    void flush_data();
-
+    void send_window_update_nolock();
+    size_t send_window_nolock();
+    void send_data(unsigned char *txbuf, size_t len);
+    bool forward_client_data();
+    void flush_client_nolock();
+    uint32_t client_interest_nolock();
+    void rearm_nolock();
+    void finish_connect_nolock(bool success) noexcept;
+    void take_client_nolock() noexcept;
     
 public:
     static constexpr int bufsize = 0x80000;
+    static constexpr int bufkeep = 0x10000; //stays committed when the ring runs empty
     static constexpr int TCP_MTU = (USB_MTU-sizeof(tcphdr)-sizeof(USBDevice::mux_header))&0xff00;
 
-    TCP(uint16_t sPort, uint16_t dPort, std::shared_ptr<USBDevice> dev, std::shared_ptr<Client> cli);
+    TCP(uint16_t sPort, uint16_t dPort, std::shared_ptr<USBDevice> dev, std::shared_ptr<Client> cli, TCPManager *mgr);
     ~TCP();
 
 #pragma mark inheritance members
@@ -68,8 +79,13 @@ public:
 #pragma mark members
     void handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_len);
     void connect();
+    void handle_client_events(uint32_t events);
+    void complete_handover() noexcept;
 
 #pragma mark static
     static void send_RST(USBDevice *dev, tcphdr *hdr);
+
+#pragma mark friends
+    friend USBDevice;
 };
 #endif /* TCP_hpp */
@@ -185,7 +185,14 @@ static void usage(){
     printf("      --allow-heartless-wifi\tAllow WIFI devices without heartbeat to be listed (needed for WIFI pairing)\n");
     printf("      --no-usb\t\t\tDo not start USBDeviceManager\n");
     printf("      --no-wifi\t\t\tDo not start WIFIDeviceManager\n");
+    printf("      --tcp-workers NUM\t\tNumber of threads serving TCP connections (default: auto)\n");
+    printf("      --usb-rx-depth NUM\t\tMax USB RX transfers in flight per device (default: by USB speed)\n");
+    printf("      --client-overflow POLICY\tWhat to do with clients which don't read their messages:\n");
+    printf("                              \t'disconnect' (default) or 'coalesce' pending device notifications\n");
     printf("      --pair-record-id ID\t\tSet the pair record ID for the connection\n");
+    printf("      --record-store FILE\t\tKeep pair records in a single indexed store file\n");
+    printf("                         \t\t(create or convert it with usbmuxd2-records)\n");
+    printf("                         \t\twith --user, the directory of FILE must belong to USER\n");
     printf("\n");
 }
 
@@ -209,6 +216,10 @@ static void parse_opts(int argc, const char **argv){
         {"debug",                   no_argument,        NULL,  0 },
         {"no-usb",                  optional_argument,  NULL,  0 },
         {"no-wifi",                 optional_argument,  NULL,  0 },
+        {"tcp-workers",             required_argument,  NULL,  0 },
+        {"usb-rx-depth",            required_argument,  NULL,  0 },
+        {"client-overflow",         required_argument,  NULL,  0 },
+        {"record-store",            required_argument,  NULL,  0 },
         {"connect",                 required_argument,  NULL, 'c'},
         {"pair-record-id",          required_argument,  NULL, 'i'},
         {NULL,                      0,                  NULL,  0 }
@@ -240,6 +251,39 @@ static void parse_opts(int argc, const char **argv){
                 }else if (curopt == "no-wifi") {
                     info("Manually disabling WIFIDeviceManager");
                     gConfig->enableWifiDeviceManager = (!optarg) ? false : atoi(optarg);
+                }else if (curopt == "tcp-workers") {
+                    int workers = atoi(optarg);
+                    if (workers <= 0) {
+                        fatal("ERROR: --tcp-workers requires a positive number");
+                        usage();
+                        exit(2);
+                    }
+                    gConfig->tcpWorkers = workers;
+                }else if (curopt == "usb-rx-depth") {
+                    int depth = atoi(optarg);
+                    if (depth <= 0) {
+                        fatal("ERROR: --usb-rx-depth requires a positive number");
+                        usage();
+                        exit(2);
+                    }
+                    gConfig->usbRxDepthMax = depth;
+                }else if (curopt == "client-overflow") {
+                    if (!strcmp(optarg, "disconnect")) {
+                        gConfig->clientOverflowCoalesce = false;
+                    } else if (!strcmp(optarg, "coalesce")) {
+                        gConfig->clientOverflowCoalesce = true;
+                    } else {
+                        fatal("ERROR: --client-overflow requires 'disconnect' or 'coalesce'");
+                        usage();
+                        exit(2);
+                    }
+                }else if (curopt == "record-store") {
+                    if (!*optarg) {
+                        fatal("ERROR: --record-store requires a non-empty filename");
+                        usage();
+                        exit(2);
+                    }
+                    gConfig->recordStore = optarg;
                 }
             }
                 break;
@@ -403,6 +447,14 @@ int main(int argc, const char * argv[]) {
         cretassure(write(lfd, pids, strlen(pids)) == strlen(pids), "Could not write pidfile!");
     }
 
+    if (gConfig->recordStore.size()) {
+        try{
+            sysconf_use_record_store(gConfig->recordStore);
+        }catch (tihmstar::exception &e){
+            creterror("failed to open record store %s with error=%d (%s)",gConfig->recordStore.c_str(),e.code(),e.what());
+        }
+    }
+
     if (!gConfig->doPreflight){
         info("Preflight disabled by config or commandline!");
     }
@@ -419,6 +471,15 @@ int main(int argc, const char * argv[]) {
         cassure(0);
     }
 
+    try{
+        mux->spawnTCPManager(gConfig->tcpWorkers);
+        info("Inited TCPManager");
+    }catch (tihmstar::exception &e){
+        fatal("failed to spawnTCPManager with error=%d (%s)",e.code(),e.what());
+        fatal("Terminating since a TCPManager is require to operate");
+        cassure(0);
+    }
+
     // drop elevated privileges
     if (gConfig->dropUser.size() && (getuid() == 0 || geteuid() == 0)) {
         struct passwd *pw = NULL; // don't free this
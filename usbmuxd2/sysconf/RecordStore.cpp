@@ -0,0 +1,521 @@
+//
+//  RecordStore.cpp
+//  usbmuxd2
+//
+
+#include "RecordStore.hpp"
+#include <libgeneral/macros.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+#define RECORDSTORE_MAGIC           "UMX2RST1"
+#define RECORDSTORE_VERSION         1
+#define RECORDSTORE_JOURNAL_MAGIC   0x314a5855 //'UXJ1'
+#define RECORDSTORE_REMOVED         UINT32_MAX
+
+/*
+ Store file layout, in host byte order:
+    store_header
+    UDIDs, macaddrs and records
+    store_entry[count]      sorted by UDID
+    uint32_t[count]         entry numbers sorted by macaddr, entries without macaddr are left out
+ */
+struct store_header{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t macaddrCount;
+    uint32_t reserved;
+    uint64_t entriesOff;
+    uint64_t macaddrIndexOff;
+    uint64_t size;
+};
+
+struct store_entry{
+    uint64_t udidOff;
+    uint64_t macaddrOff;
+    uint64_t dataOff;
+    uint32_t udidLen;
+    uint32_t macaddrLen;
+    uint32_t dataLen;
+    uint32_t reserved;
+};
+
+/*
+ Journal entry, followed by UDID, macaddr, record and the checksum of all of it.
+ dataLen is RECORDSTORE_REMOVED for removed records.
+ */
+struct journal_entry{
+    uint32_t magic;
+    uint32_t udidLen;
+    uint32_t macaddrLen;
+    uint32_t dataLen;
+};
+
+#pragma mark helpers
+static uint32_t fnv1a(const void *buf, size_t len, uint32_t hash = 0x811c9dc5) noexcept{
+    const uint8_t *p = (const uint8_t *)buf;
+    for (size_t i=0; i<len; i++) {
+        hash ^= p[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static int sync_fd(int fd){
+#ifdef F_FULLFSYNC
+    if (fcntl(fd, F_FULLFSYNC) == 0) return 0;
+#endif
+    return fsync(fd);
+}
+
+static void write_all(int fd, const void *buf, size_t len, const std::string &path){
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        retassure(w > 0, "Failed to write %s: %s",path.c_str(),strerror(errno));
+        p += w;
+        len -= w;
+    }
+}
+
+static void sync_parent_dir(const std::string &path) noexcept{
+    size_t slash = path.find_last_of('/');
+    std::string dir = (slash == std::string::npos) ? std::string(".") : path.substr(0, slash+1);
+    int dirfd = -1;
+    if ((dirfd = open(dir.c_str(), O_RDONLY | O_CLOEXEC)) != -1) {
+        sync_fd(dirfd);
+        close(dirfd);
+    }
+}
+
+#pragma mark RecordStore
+RecordStore::RecordStore(const std::string &path)
+: _path(path), _journalPath(path + ".journal")
+, _journalfd(-1), _map(NULL), _mapSize(0), _journalEntries(0), _compactAt(RECORDSTORE_JOURNAL_MAX)
+{
+    bool didInit = false;
+    cleanup([&]{
+        if (!didInit) {
+            unmap_store();
+            safeClose(_journalfd);
+        }
+    });
+
+    retassure((_journalfd = open(_journalPath.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) != -1, "Failed to open %s: %s",_journalPath.c_str(),strerror(errno));
+    //compaction truncates the journal, another process appending to it would lose its changes
+    if (flock(_journalfd, LOCK_EX | LOCK_NB)) {
+        retassure(errno != EWOULDBLOCK, "%s is in use by another process",_path.c_str());
+        reterror("Failed to lock %s: %s",_journalPath.c_str(),strerror(errno));
+    }
+    map_store(&_map, &_mapSize);
+    replay_journal();
+    info("Opened pair record store %s with %u journal entries",_path.c_str(),_journalEntries);
+    didInit = true;
+}
+
+RecordStore::~RecordStore(){
+    unmap_store();
+    safeClose(_journalfd);
+}
+
+/*
+ Hands the store and its journal to uid. Goes through file descriptors,
+ so a symlink planted in the store's directory can't redirect it.
+ */
+void RecordStore::set_owner(uid_t uid, gid_t gid){
+    std::unique_lock<std::mutex> ul(_lck);
+    int fd = -1;
+    cleanup([&]{
+        safeClose(fd);
+    });
+    retassure(!fchown(_journalfd, uid, gid), "Failed to chown %s: %s",_journalPath.c_str(),strerror(errno));
+    if ((fd = open(_path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+        retassure(errno == ENOENT, "Failed to open %s: %s",_path.c_str(),strerror(errno));
+        return; //no store yet
+    }
+    retassure(!fchown(fd, uid, gid), "Failed to chown %s: %s",_path.c_str(),strerror(errno));
+}
+
+/*
+ Maps and validates the store file, leaves *outMap NULL if there is none yet.
+ Doesn't touch the current mapping, so a failure leaves the store as it was.
+ */
+void RecordStore::map_store(const uint8_t **outMap, size_t *outMapSize) const{
+    int fd = -1;
+    const uint8_t *map = (const uint8_t *)MAP_FAILED;
+    size_t mapSize = 0;
+    cleanup([&]{
+        safeClose(fd);
+        if (map != MAP_FAILED) munmap((void*)map, mapSize);
+    });
+    struct stat st{};
+    const store_header *hdr = NULL;
+
+    *outMap = NULL;
+    *outMapSize = 0;
+    if ((fd = open(_path.c_str(), O_RDONLY | O_CLOEXEC)) == -1) {
+        retassure(errno == ENOENT, "Failed to open %s: %s",_path.c_str(),strerror(errno));
+        return; //no store yet, everything lives in the journal until the first compaction
+    }
+    retassure(!fstat(fd, &st), "Failed to stat %s: %s",_path.c_str(),strerror(errno));
+    retassure((size_t)st.st_size >= sizeof(store_header), "%s is too small to be a record store",_path.c_str());
+    retassure((map = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED, "Failed to map %s: %s",_path.c_str(),strerror(errno));
+    mapSize = st.st_size;
+
+    hdr = (const store_header *)map;
+    retassure(!memcmp(hdr->magic, RECORDSTORE_MAGIC, sizeof(hdr->magic)) && hdr->version == RECORDSTORE_VERSION, "%s is not a record store",_path.c_str());
+    retassure(hdr->size == mapSize, "%s is truncated",_path.c_str());
+    retassure(hdr->macaddrCount <= hdr->count
+              && hdr->entriesOff <= mapSize && (mapSize - hdr->entriesOff) / sizeof(store_entry) >= hdr->count
+              && hdr->macaddrIndexOff <= mapSize && (mapSize - hdr->macaddrIndexOff) / sizeof(uint32_t) >= hdr->macaddrCount,
+              "%s has a corrupted index",_path.c_str());
+
+    *outMap = map; map = (const uint8_t *)MAP_FAILED;
+    *outMapSize = mapSize;
+}
+
+void RecordStore::unmap_store() noexcept{
+    if (_map && _map != MAP_FAILED) munmap((void*)_map, _mapSize);
+    _map = NULL;
+    _mapSize = 0;
+}
+
+void RecordStore::replay_journal(){
+    std::string buf;
+    size_t off = 0;
+    {
+        struct stat st{};
+        retassure(!fstat(_journalfd, &st), "Failed to stat %s: %s",_journalPath.c_str(),strerror(errno));
+        buf.resize(st.st_size);
+        for (size_t didRead = 0; didRead < buf.size();) {
+            ssize_t r = pread(_journalfd, &buf[didRead], buf.size()-didRead, didRead);
+            if (r < 0 && errno == EINTR) continue;
+            retassure(r > 0, "Failed to read %s: %s",_journalPath.c_str(),strerror(errno));
+            didRead += r;
+        }
+    }
+
+    while (buf.size() - off >= sizeof(journal_entry)) {
+        journal_entry je{};
+        uint32_t checksum = 0;
+        size_t payloadLen = 0;
+        memcpy(&je, &buf[off], sizeof(je));
+        payloadLen = (size_t)je.udidLen + je.macaddrLen + (je.dataLen == RECORDSTORE_REMOVED ? 0 : je.dataLen);
+        if (je.magic != RECORDSTORE_JOURNAL_MAGIC || buf.size() - off - sizeof(je) < payloadLen + sizeof(checksum)) break;
+        memcpy(&checksum, &buf[off + sizeof(je) + payloadLen], sizeof(checksum));
+        if (checksum != fnv1a(&buf[off], sizeof(je) + payloadLen)) break;
+
+        {
+            const char *p = &buf[off + sizeof(je)];
+            std::string udid(p, je.udidLen);
+            change c{};
+            c.macaddr = std::string(p + je.udidLen, je.macaddrLen);
+            if (je.dataLen != RECORDSTORE_REMOVED) {
+                c.data = std::make_shared<const std::string>(p + je.udidLen + je.macaddrLen, je.dataLen);
+            }
+            apply_change_nolock(udid, c);
+        }
+        _journalEntries++;
+        off += sizeof(je) + payloadLen + sizeof(checksum);
+    }
+
+    if (off != buf.size()) {
+        //torn write from a crash, entries behind it can't exist as appends stop at the first failure
+        warning("Dropping %zu bytes of incomplete journal entries from %s",buf.size()-off,_journalPath.c_str());
+        retassure(!ftruncate(_journalfd, off), "Failed to truncate %s: %s",_journalPath.c_str(),strerror(errno));
+    }
+    maybe_compact_nolock();
+}
+
+void RecordStore::append_journal(const std::string &udid, const change &c){
+    journal_entry je{RECORDSTORE_JOURNAL_MAGIC, (uint32_t)udid.size(), (uint32_t)c.macaddr.size(), c.data ? (uint32_t)c.data->size() : RECORDSTORE_REMOVED};
+    std::string buf;
+    uint32_t checksum = 0;
+    off_t prevSize = 0;
+
+    retassure(!c.data || c.data->size() < RECORDSTORE_REMOVED, "Record of %s is too big",udid.c_str());
+    buf.append((const char *)&je, sizeof(je));
+    buf += udid;
+    buf += c.macaddr;
+    if (c.data) buf += *c.data;
+    checksum = fnv1a(buf.data(), buf.size());
+    buf.append((const char *)&checksum, sizeof(checksum));
+
+    retassure((prevSize = lseek(_journalfd, 0, SEEK_END)) != -1, "Failed to seek %s: %s",_journalPath.c_str(),strerror(errno));
+    try {
+        write_all(_journalfd, buf.data(), buf.size(), _journalPath);
+        retassure(!sync_fd(_journalfd), "Failed to sync %s: %s",_journalPath.c_str(),strerror(errno));
+    } catch (...) {
+        //don't leave a partial entry in front of the next one
+        if (ftruncate(_journalfd, prevSize)) error("Failed to truncate %s: %s",_journalPath.c_str(),strerror(errno));
+        throw;
+    }
+    _journalEntries++;
+}
+
+void RecordStore::apply_change_nolock(const std::string &udid, change c) noexcept{
+    auto prev = _changes.find(udid);
+    if (prev != _changes.end()) {
+        auto m = _changedMacaddrs.find(prev->second.macaddr);
+        if (m != _changedMacaddrs.end() && m->second == udid) _changedMacaddrs.erase(m);
+    }
+    if (c.data && c.macaddr.size()) _changedMacaddrs[c.macaddr] = udid;
+    _changes[udid] = std::move(c);
+}
+
+void RecordStore::compact_nolock(){
+    struct merged_record{
+        std::string_view udid;
+        std::string_view macaddr;
+        std::string_view data;
+    };
+    std::vector<merged_record> records;
+    std::vector<uint32_t> macaddrIndex;
+    std::vector<store_entry> entries;
+    store_header hdr{};
+    std::string tmppath = _path + ".tmp";
+    int fd = -1;
+    bool didRename = false;
+    cleanup([&]{
+        safeClose(fd);
+        if (!didRename) unlink(tmppath.c_str());
+    });
+    uint64_t off = sizeof(store_header);
+
+    //merge the mapped store with the changes on top of it, keeping UDID order
+    if (_map) {
+        const store_header *mhdr = (const store_header *)_map;
+        const store_entry *mentries = (const store_entry *)(_map + mhdr->entriesOff);
+        for (uint32_t i=0; i<mhdr->count; i++) {
+            const store_entry &e = mentries[i];
+            if (e.udidOff + e.udidLen > _mapSize || e.macaddrOff + e.macaddrLen > _mapSize || e.dataOff + e.dataLen > _mapSize) continue;
+            merged_record r{std::string_view((const char *)_map + e.udidOff, e.udidLen),
+                            std::string_view((const char *)_map + e.macaddrOff, e.macaddrLen),
+                            std::string_view((const char *)_map + e.dataOff, e.dataLen)};
+            if (_changes.find(std::string(r.udid)) != _changes.end()) continue;
+            records.push_back(r);
+        }
+    }
+    for (auto &c : _changes) {
+        if (!c.second.data) continue;
+        records.push_back({c.first, c.second.macaddr, *c.second.data});
+    }
+    std::sort(records.begin(), records.end(), [](const merged_record &a, const merged_record &b){
+        return a.udid < b.udid;
+    });
+
+    retassure((fd = open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) != -1, "Failed to create %s: %s",tmppath.c_str(),strerror(errno));
+    retassure(lseek(fd, sizeof(store_header), SEEK_SET) == sizeof(store_header), "Failed to seek %s: %s",tmppath.c_str(),strerror(errno));
+    for (uint32_t i=0; i<records.size(); i++) {
+        store_entry e{};
+        auto &r = records[i];
+        e.udidOff = off; e.udidLen = (uint32_t)r.udid.size();
+        write_all(fd, r.udid.data(), r.udid.size(), tmppath); off += r.udid.size();
+        e.macaddrOff = off; e.macaddrLen = (uint32_t)r.macaddr.size();
+        write_all(fd, r.macaddr.data(), r.macaddr.size(), tmppath); off += r.macaddr.size();
+        e.dataOff = off; e.dataLen = (uint32_t)r.data.size();
+        write_all(fd, r.data.data(), r.data.size(), tmppath); off += r.data.size();
+        entries.push_back(e);
+        if (r.macaddr.size()) macaddrIndex.push_back(i);
+    }
+    std::sort(macaddrIndex.begin(), macaddrIndex.end(), [&records](uint32_t a, uint32_t b){
+        return records[a].macaddr < records[b].macaddr;
+    });
+    {
+        static const char pad[sizeof(uint64_t)] = {};
+        size_t padLen = (sizeof(uint64_t) - off % sizeof(uint64_t)) % sizeof(uint64_t);
+        write_all(fd, pad, padLen, tmppath); off += padLen;
+    }
+    hdr.entriesOff = off;
+    write_all(fd, entries.data(), entries.size() * sizeof(store_entry), tmppath); off += entries.size() * sizeof(store_entry);
+    hdr.macaddrIndexOff = off;
+    write_all(fd, macaddrIndex.data(), macaddrIndex.size() * sizeof(uint32_t), tmppath); off += macaddrIndex.size() * sizeof(uint32_t);
+
+    memcpy(hdr.magic, RECORDSTORE_MAGIC, sizeof(hdr.magic));
+    hdr.version = RECORDSTORE_VERSION;
+    hdr.count = (uint32_t)entries.size();
+    hdr.macaddrCount = (uint32_t)macaddrIndex.size();
+    hdr.size = off;
+    retassure(pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr), "Failed to write %s: %s",tmppath.c_str(),strerror(errno));
+    retassure(!sync_fd(fd), "Failed to sync %s: %s",tmppath.c_str(),strerror(errno));
+    retassure(!rename(tmppath.c_str(), _path.c_str()), "Failed to move %s to %s: %s",tmppath.c_str(),_path.c_str(),strerror(errno));
+    didRename = true;
+    sync_parent_dir(_path);
+
+    /*
+     The new store holds everything, replaying the journal on top of it after a crash right here is harmless.
+     Until the new store is mapped, the old mapping with the changes on top of it is just as good.
+     */
+    records.clear();
+    {
+        const uint8_t *newMap = NULL;
+        size_t newMapSize = 0;
+        map_store(&newMap, &newMapSize);
+        unmap_store();
+        _map = newMap;
+        _mapSize = newMapSize;
+    }
+    _changes.clear();
+    _changedMacaddrs.clear();
+    retassure(!ftruncate(_journalfd, 0), "Failed to truncate %s: %s",_journalPath.c_str(),strerror(errno));
+    sync_fd(_journalfd);
+    _journalEntries = 0;
+    _compactAt = RECORDSTORE_JOURNAL_MAX;
+    debug("Compacted pair record store %s to %u records",_path.c_str(),hdr.count);
+}
+
+/*
+ Compaction failing doesn't undo changes which are in the journal already,
+ so it's only logged and tried again once another RECORDSTORE_JOURNAL_MAX changes came in
+ */
+void RecordStore::maybe_compact_nolock() noexcept{
+    if (_journalEntries < _compactAt) return;
+    try {
+        compact_nolock();
+    } catch (tihmstar::exception &e) {
+        _compactAt = _journalEntries + RECORDSTORE_JOURNAL_MAX;
+        error("Failed to compact %s, retrying after %u more changes error=%d (%s)",_path.c_str(),RECORDSTORE_JOURNAL_MAX,e.code(),e.what());
+    }
+}
+
+bool RecordStore::base_find(std::string_view udid, std::string_view *data, std::string_view *macaddr) const noexcept{
+    if (!_map) return false;
+    const store_header *hdr = (const store_header *)_map;
+    const store_entry *entries = (const store_entry *)(_map + hdr->entriesOff);
+    uint32_t lo = 0;
+    uint32_t hi = hdr->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const store_entry &e = entries[mid];
+        if (e.udidOff + e.udidLen > _mapSize) return false;
+        std::string_view cur((const char *)_map + e.udidOff, e.udidLen);
+        if (cur < udid) {
+            lo = mid + 1;
+        } else if (cur > udid) {
+            hi = mid;
+        } else {
+            if (e.dataOff + e.dataLen > _mapSize || e.macaddrOff + e.macaddrLen > _mapSize) return false;
+            if (data) *data = std::string_view((const char *)_map + e.dataOff, e.dataLen);
+            if (macaddr) *macaddr = std::string_view((const char *)_map + e.macaddrOff, e.macaddrLen);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RecordStore::base_find_macaddr(std::string_view macaddr, std::string_view *udid) const noexcept{
+    if (!_map) return false;
+    const store_header *hdr = (const store_header *)_map;
+    const store_entry *entries = (const store_entry *)(_map + hdr->entriesOff);
+    const uint32_t *index = (const uint32_t *)(_map + hdr->macaddrIndexOff);
+    uint32_t lo = 0;
+    uint32_t hi = hdr->macaddrCount;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index[mid] >= hdr->count) return false;
+        const store_entry &e = entries[index[mid]];
+        if (e.macaddrOff + e.macaddrLen > _mapSize || e.udidOff + e.udidLen > _mapSize) return false;
+        std::string_view cur((const char *)_map + e.macaddrOff, e.macaddrLen);
+        if (cur < macaddr) {
+            lo = mid + 1;
+        } else if (cur > macaddr) {
+            hi = mid;
+        } else {
+            *udid = std::string_view((const char *)_map + e.udidOff, e.udidLen);
+            return true;
+        }
+    }
+    return false;
+}
+
+#pragma mark public
+RecordStore::record RecordStore::get(const std::string &udid){
+    std::unique_lock<std::mutex> ul(_lck);
+    std::string_view data;
+    auto c = _changes.find(udid);
+    if (c != _changes.end()) return c->second.data;
+    if (!base_find(udid, &data, NULL)) return nullptr;
+    return std::make_shared<const std::string>(data);
+}
+
+std::string RecordStore::udid_for_macaddr(const std::string &macaddr){
+    std::unique_lock<std::mutex> ul(_lck);
+    std::string_view udid;
+    auto m = _changedMacaddrs.find(macaddr);
+    if (m != _changedMacaddrs.end()) return m->second;
+    if (!base_find_macaddr(macaddr, &udid)) return {};
+    //a changed record with this macaddr would have been found above
+    if (_changes.find(std::string(udid)) != _changes.end()) return {};
+    return std::string(udid);
+}
+
+std::vector<std::string> RecordStore::list(){
+    std::unique_lock<std::mutex> ul(_lck);
+    std::vector<std::string> ret;
+    if (_map) {
+        const store_header *hdr = (const store_header *)_map;
+        const store_entry *entries = (const store_entry *)(_map + hdr->entriesOff);
+        for (uint32_t i=0; i<hdr->count; i++) {
+            const store_entry &e = entries[i];
+            if (e.udidOff + e.udidLen > _mapSize) continue;
+            std::string udid((const char *)_map + e.udidOff, e.udidLen);
+            if (_changes.find(udid) == _changes.end()) ret.push_back(udid);
+        }
+    }
+    for (auto &c : _changes) {
+        if (c.second.data) ret.push_back(c.first);
+    }
+    return ret;
+}
+
+void RecordStore::set(const std::string &udid, const std::string &bin, const std::string &macaddr){
+    std::unique_lock<std::mutex> ul(_lck);
+    change c{std::make_shared<const std::string>(bin), macaddr};
+    append_journal(udid, c);
+    apply_change_nolock(udid, std::move(c));
+    maybe_compact_nolock();
+}
+
+/*
+ returns false if there was no record for udid
+ */
+bool RecordStore::remove(const std::string &udid){
+    std::unique_lock<std::mutex> ul(_lck);
+    {
+        auto c = _changes.find(udid);
+        if (c != _changes.end() ? !c->second.data : !base_find(udid, NULL, NULL)) return false;
+    }
+    change c{};
+    append_journal(udid, c);
+    apply_change_nolock(udid, std::move(c));
+    maybe_compact_nolock();
+    return true;
+}
+
+/*
+ Adds many records with a single store rewrite. Unlike set(), records aren't journaled,
+ they become durable with the compaction at the end. If that fails, they stay in memory
+ and are written by the next compaction which succeeds.
+ */
+void RecordStore::import(std::vector<import_record> records){
+    std::unique_lock<std::mutex> ul(_lck);
+    for (auto &r : records) {
+        retassure(r.bin.size() < RECORDSTORE_REMOVED, "Record of %s is too big",r.udid.c_str());
+        apply_change_nolock(r.udid, {std::make_shared<const std::string>(std::move(r.bin)), std::move(r.macaddr)});
+    }
+    records.clear();
+    compact_nolock();
+}
+
+void RecordStore::compact(){
+    std::unique_lock<std::mutex> ul(_lck);
+    compact_nolock();
+}
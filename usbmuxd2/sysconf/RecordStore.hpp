@@ -0,0 +1,83 @@
+//
+//  RecordStore.hpp
+//  usbmuxd2
+//
+
+#ifndef RecordStore_hpp
+#define RecordStore_hpp
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define RECORDSTORE_JOURNAL_MAX 0x100   //journal entries after which they are folded into the store file
+
+/*
+ Single-file store of pair records in binary plist form, for hosts with lots of records.
+
+ The store file is memory mapped. It holds all records, an index sorted by UDID and an index sorted by
+ WiFiMACAddress, so opening it and looking records up doesn't depend on how many records there are.
+ Changes are appended to <path>.journal and kept in memory on top of the mapping. Once the journal
+ holds RECORDSTORE_JOURNAL_MAX entries, everything is written into a fresh store file which replaces the old one.
+ Only one process at a time may have a store open, the journal is locked while it is.
+ */
+class RecordStore {
+public:
+    typedef std::shared_ptr<const std::string> record;
+    struct import_record{
+        std::string udid;
+        std::string bin;
+        std::string macaddr;
+    };
+private:
+    struct change{
+        record data;        //nullptr if the record was removed
+        std::string macaddr;
+    };
+    std::string _path;
+    std::string _journalPath;
+    std::mutex _lck;
+    int _journalfd;
+    const uint8_t *_map;
+    size_t _mapSize;
+    uint32_t _journalEntries;
+    uint32_t _compactAt;                                      //journal entries at which the next compaction is attempted
+    std::map<std::string, change> _changes;                   //by UDID, overrides the mapped store
+    std::map<std::string, std::string> _changedMacaddrs;      //macaddr -> UDID of records in _changes
+
+    void map_store(const uint8_t **outMap, size_t *outMapSize) const;
+    void unmap_store() noexcept;
+    void replay_journal();
+    void append_journal(const std::string &udid, const change &c);
+    void apply_change_nolock(const std::string &udid, change c) noexcept;
+    void compact_nolock();
+    void maybe_compact_nolock() noexcept;
+
+    bool base_find(std::string_view udid, std::string_view *data, std::string_view *macaddr) const noexcept;
+    bool base_find_macaddr(std::string_view macaddr, std::string_view *udid) const noexcept;
+
+public:
+    RecordStore(const std::string &path);  //creates an empty store if there is none
+    RecordStore(const RecordStore &) = delete;
+    ~RecordStore();
+
+    const std::string &path() const noexcept {return _path;};
+    const std::string &journalPath() const noexcept {return _journalPath;};
+    void set_owner(uid_t uid, gid_t gid);
+
+    record get(const std::string &udid);                   //nullptr if there is no record
+    std::string udid_for_macaddr(const std::string &macaddr);  //empty if no record has macaddr
+    std::vector<std::string> list();
+
+    void set(const std::string &udid, const std::string &bin, const std::string &macaddr);
+    bool remove(const std::string &udid);
+    void import(std::vector<import_record> records);
+    void compact();
+};
+
+#endif /* RecordStore_hpp */
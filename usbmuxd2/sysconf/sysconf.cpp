@@ -6,6 +6,7 @@
 //
 
 #include "sysconf.hpp"
+#include "RecordStore.hpp"
 #include <sys/stat.h>
 #include <unistd.h>
 #include <libgeneral/macros.h>
@@ -16,21 +17,81 @@
 #include <dirent.h>
 #include <string.h>
 #include <mutex>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+#ifndef __APPLE__
+#   include <sys/inotify.h>
+#endif
 
 #define CONFIG_DIR  "lockdown"
 #define CONFIG_FILE "SystemConfiguration"
 
+#define MACADDR_INDEX_FILE  ".macaddrs.idx"  //sidecar of the macaddr index
+#define MACADDR_INDEX_MAGIC "usbmuxd2-macaddrs-2"
+#define MACADDR_INDEX_COMPACT_MIN 0x40      //appended changes after which the sidecar is rewritten, at least
+
+#define RECORD_COMMIT_WINDOW_MS 2           //how long a commit waits for more writers to share its syncs
+
 #define CONFIG_SYSTEM_BUID_KEY "SystemBUID"
 #define CONFIG_HOST_ID_KEY "HostID"
 
 #ifdef __APPLE__
 #   define BASE_CONFIG_DIR "/var/db"
+#   define ST_MTIM(st) (st).st_mtimespec
 #else
 #   define BASE_CONFIG_DIR "/var/lib"
+#   define ST_MTIM(st) (st).st_mtim
 #endif
 
+/*
+ WiFi macaddr -> UDID of the pair records in the config dir.
+ Updated per record when records are written or removed and persisted in a sidecar file,
+ so neither pairing nor startup need to parse every record.
+ */
+struct macaddr_entry{
+    std::string macaddr;                            //empty if the record has none
+    off_t size;                                     //of the record file the macaddr was read from
+    struct timespec mtime;
+    uint64_t commitSeq;                             //of the write the entry was taken from, 0 if read from disk, not persisted
+};
 static std::map<std::string,std::string> gKnownMacAddrs;
-static std::mutex gKnownMacAddrsLck;
+static std::map<std::string,macaddr_entry> gMacAddrForUdid;
+static bool gKnownMacAddrsDidLoad = false;
+static struct timespec gKnownMacAddrsDirMtime = {};  //of the config dir when the index was loaded
+static size_t gKnownMacAddrsAppends = 0;            //changes appended to the sidecar since it was last rewritten
+static std::mutex gKnownMacAddrsLck;                //guards all of the above
+
+/*
+ Parsed pair records and their binary encoding, by UDID.
+ On Linux the cache is kept coherent with external edits through inotify on the config dir,
+ on darwin every hit is validated with a stat of the record file.
+ */
+struct device_record_entry{
+    std::shared_ptr<void> record;                   //nullptr if there is no record for the UDID
+    std::shared_ptr<const std::string> bin;
+#ifdef __APPLE__
+    struct stat st;                                 //of the file the record was read from
+#endif
+};
+static std::map<std::string,device_record_entry> gDeviceRecords;
+static std::mutex gDeviceRecordsLck;
+static uint64_t gDeviceRecordsEpoch = 0;            //bumped whenever entries were invalidated, guarded by gDeviceRecordsLck
+#ifndef __APPLE__
+static int gDeviceRecordsWatch = -1;                //inotify fd, guarded by gDeviceRecordsLck
+static bool gDeviceRecordsDidInitWatch = false;
+#endif
+
+/*
+ If set, pair records live in this store instead of one file per record in the config dir.
+ Set once at startup before any records are accessed.
+ */
+static RecordStore *gRecordStore = NULL;
 
 const char *sysconf_get_config_dir(){
     static bool didCheckConfigEnv = false;
@@ -46,6 +107,10 @@ const char *sysconf_get_config_dir(){
     return BASE_CONFIG_DIR "/" CONFIG_DIR;
 }
 
+static bool timespec_differ(const struct timespec &a, const struct timespec &b){
+    return a.tv_sec != b.tv_sec || a.tv_nsec != b.tv_nsec;
+}
+
 static plist_t readPlist(const char *filePath){
     int fd = -1;
     char *fbuf = NULL;
@@ -130,15 +195,159 @@ std::string get_device_record_path(const char *udid){
     return ret;
 }
 
-static void sysconf_load_known_macaddrs(){
-    std::unique_lock<std::mutex> ul(gKnownMacAddrsLck);
-    const char *config_path = sysconf_get_config_dir();
+static uint64_t writeFileAtomic(const char *buf, size_t bufLen, const char *dst, struct stat *st = NULL);
 
-    sysconf_create_config_dir();
+#pragma mark macaddr index
+static bool record_file_udid(const char *name, std::string &udid){
+    size_t len = strlen(name);
+    if (name[0] == '.' || len <= sizeof(".plist")-1 || strcmp(name+len-(sizeof(".plist")-1), ".plist")) return false;
+    udid = std::string(name, len-(sizeof(".plist")-1));
+    return udid != CONFIG_FILE;
+}
+
+static std::string record_macaddr(plist_t p_devrecord){
+    plist_t p_macaddr = NULL;
+    const char *str = NULL;
+    uint64_t str_len = 0;
+    retassure(p_macaddr = plist_dict_get_item(p_devrecord, "WiFiMACAddress"), "Failed to read macaddr from pairing record");
+    retassure(str = plist_get_string_ptr(p_macaddr, &str_len), "Faile to get str ptr from MacAddress");
+    return std::string(str,str_len);
+}
+
+static void macaddr_index_set_nolock(const std::string &udid, const macaddr_entry &entry){
+    auto old = gMacAddrForUdid.find(udid);
+    if (old != gMacAddrForUdid.end()) {
+        auto m = gKnownMacAddrs.find(old->second.macaddr);
+        if (m != gKnownMacAddrs.end() && m->second == udid) gKnownMacAddrs.erase(m);
+    }
+    gMacAddrForUdid[udid] = entry;
+    if (entry.macaddr.size()) {
+        debug("adding macaddr=%s for uuid=%s",entry.macaddr.c_str(),udid.c_str());
+        gKnownMacAddrs[entry.macaddr] = udid;
+    }
+}
+
+static void macaddr_index_erase_nolock(const std::string &udid){
+    auto old = gMacAddrForUdid.find(udid);
+    if (old == gMacAddrForUdid.end()) return;
+    {
+        auto m = gKnownMacAddrs.find(old->second.macaddr);
+        if (m != gKnownMacAddrs.end() && m->second == udid) gKnownMacAddrs.erase(m);
+    }
+    gMacAddrForUdid.erase(old);
+}
+
+/*
+ Sidecar format, the magic followed by one line per change, in the order they happened.
+ Records without a macaddr use "-":
+    + <udid> <macaddr> <size> <mtime sec> <mtime nsec>
+    - <udid>
+ Changes are appended, once there are more changes than records the sidecar is rewritten
+ with one line per record. It's only a hint: every entry is checked against size and mtime
+ of its record file when loading, so lost or torn appends just cause that record to be parsed again.
+ */
+static std::string macaddr_index_path(){
+    return std::string(sysconf_get_config_dir()) + "/" MACADDR_INDEX_FILE;
+}
+
+static std::string macaddr_index_line(const std::string &udid, const macaddr_entry *e){
+    char buf[0x80] = {};
+    if (!e) return "- " + udid + "\n";
+    snprintf(buf, sizeof(buf), " %lld %lld %ld\n", (long long)e->size, (long long)e->mtime.tv_sec, (long)e->mtime.tv_nsec);
+    return "+ " + udid + " " + (e->macaddr.size() ? e->macaddr : std::string("-")) + buf;
+}
+
+static void macaddr_index_save_nolock(){
+    std::string buf = MACADDR_INDEX_MAGIC "\n";
+    for (auto &e : gMacAddrForUdid) {
+        buf += macaddr_index_line(e.first, &e.second);
+    }
+    try {
+        writeFileAtomic(buf.data(), buf.size(), macaddr_index_path().c_str());
+        gKnownMacAddrsAppends = 0;
+    } catch (tihmstar::exception &e) {
+        warning("Failed to write macaddr index with error=%d (%s)",e.code(),e.what());
+    }
+}
+
+/*
+ Records a change of a single entry, e is NULL if the record was removed
+ */
+static void macaddr_index_append_nolock(const std::string &udid, const macaddr_entry *e){
+    int fd = -1;
+    cleanup([&]{
+        safeClose(fd);
+    });
+    std::string line = macaddr_index_line(udid, e);
+    std::string path = macaddr_index_path();
+
+    if (++gKnownMacAddrsAppends >= std::max<size_t>(MACADDR_INDEX_COMPACT_MIN, gMacAddrForUdid.size())
+        || (fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC)) == -1) {
+        macaddr_index_save_nolock();
+        return;
+    }
+    if (write(fd, line.data(), line.size()) != (ssize_t)line.size()) {
+        warning("Failed to append to macaddr index %s: %s",path.c_str(),strerror(errno));
+    }
+}
+
+/*
+ returns the number of changes found in the sidecar
+ */
+static size_t macaddr_index_load_sidecar(const std::string &path, std::map<std::string,macaddr_entry> &entries){
+    FILE *f = NULL;
+    cleanup([&]{
+        safeFreeCustom(f, fclose);
+    });
+    char line[0x200] = {};
+    char udid[0x100] = {};
+    char macaddr[0x40] = {};
+    long long size = 0;
+    long long sec = 0;
+    long nsec = 0;
+    size_t cnt = 0;
+
+    if (!(f = fopen(path.c_str(), "r"))) return 0;
+    if (!fgets(line, sizeof(line), f) || strcmp(line, MACADDR_INDEX_MAGIC "\n")) return 0;
+    while (fgets(line, sizeof(line), f)) {
+        macaddr_entry e{};
+        if (!strchr(line, '\n')) break; //torn append
+        if (sscanf(line, "- %255s", udid) == 1) {
+            entries.erase(udid);
+        } else if (sscanf(line, "+ %255s %63s %lld %lld %ld", udid, macaddr, &size, &sec, &nsec) == 5) {
+            if (strcmp(macaddr, "-")) e.macaddr = macaddr;
+            e.size = (off_t)size;
+            e.mtime.tv_sec = (time_t)sec;
+            e.mtime.tv_nsec = nsec;
+            entries[udid] = e;
+        } else {
+            break;
+        }
+        cnt++;
+    }
+    return cnt;
+}
+
+/*
+ Loads the index from its sidecar, checking every entry against size and mtime of its record file.
+ Only record files which aren't in the sidecar or changed since are parsed.
+ */
+static void sysconf_load_known_macaddrs_nolock(){
+    const char *config_path = sysconf_get_config_dir();
+    std::string sidecarpath = macaddr_index_path();
+    std::map<std::string,macaddr_entry> sidecar;
+    struct stat dirst{};
+    size_t sidecarChanges = 0;
+    size_t didParse = 0;
 
     gKnownMacAddrs.clear();
+    gMacAddrForUdid.clear();
+    gKnownMacAddrsDidLoad = false;
 
-    std::string sysconfigpath = get_device_record_path(CONFIG_FILE);
+    sysconf_create_config_dir();
+    assure(!stat(config_path, &dirst));
+    gKnownMacAddrsDirMtime = ST_MTIM(dirst);
+    sidecarChanges = macaddr_index_load_sidecar(sidecarpath, sidecar);
 
     {
         DIR *dir = NULL;
@@ -150,158 +359,543 @@ static void sysconf_load_known_macaddrs(){
         assure(dir = opendir(config_path));
         
         while ((ent = readdir (dir)) != NULL) {
+            std::string udid;
+            struct stat st{};
             if (ent->d_type != DT_REG)
                 continue;
+            if (!record_file_udid(ent->d_name, udid))
+                continue; //ignore sysconfig file and sidecar
             std::string path = config_path;
             path+= "/";
             path+= ent->d_name;
-            
-            if (path == sysconfigpath)
-                continue; //ignore sysconfig file
-            
+            if (stat(path.c_str(), &st))
+                continue;
+
+            {
+                auto known = sidecar.find(udid);
+                if (known != sidecar.end() && known->second.size == st.st_size && !timespec_differ(known->second.mtime, ST_MTIM(st))) {
+                    macaddr_index_set_nolock(udid, known->second);
+                    continue;
+                }
+            }
+
             debug("reading file=%s\n",path.c_str());
-            try{ //we ignore any error happening in here
-                plist_t p_devrecord = NULL;
-                cleanup([&]{
-                    safeFreeCustom(p_devrecord, plist_free);
-                });
-                plist_t p_macaddr = NULL;
-                std::string macaddr;
-
-                p_devrecord = readPlist(path.c_str());
-                
-                retassure(p_macaddr = plist_dict_get_item(p_devrecord, "WiFiMACAddress"), "Failed to read macaddr from pairing record");
-                
-                {
-                    const char *str = NULL;
-                    uint64_t str_len = 0;
-                    retassure(str = plist_get_string_ptr(p_macaddr, &str_len), "Faile to get str ptr from MacAddress");
-                    macaddr = std::string(str,str_len);
+            didParse++;
+            {
+                macaddr_entry e{};
+                e.size = st.st_size;
+                e.mtime = ST_MTIM(st);
+                try{ //we ignore any error happening in here
+                    plist_t p_devrecord = NULL;
+                    cleanup([&]{
+                        safeFreeCustom(p_devrecord, plist_free);
+                    });
+                    p_devrecord = readPlist(path.c_str());
+                    e.macaddr = record_macaddr(p_devrecord);
+                } catch (tihmstar::exception &err){
+                    debug("failed to read record with error=%d (%s)",err.code(),err.what());
                 }
-                
-                size_t lastSlashPos = path.find_last_of("/")+1;
-                size_t dotPos = path.find(".");
-
-                std::string uuid = path.substr(lastSlashPos,dotPos-lastSlashPos);
-                debug("adding macaddr=%s for uuid=%s",macaddr.c_str(),uuid.c_str());
-                
-                gKnownMacAddrs[macaddr] = uuid;
-                
-            } catch (tihmstar::exception &e){
-                debug("failed to read record with error=%d (%s)",e.code(),e.what());
+                macaddr_index_set_nolock(udid, e); //remembered without macaddr too, so it isn't parsed again
             }
-            
         }
     }
-    
+    gKnownMacAddrsDidLoad = true;
+    debug("loaded macaddr index with %zu records, %zu of them parsed",gMacAddrForUdid.size(),didParse);
+    gKnownMacAddrsAppends = 0;
+    if (didParse || sidecar.size() != gMacAddrForUdid.size() || sidecarChanges != gMacAddrForUdid.size()) {
+        //sidecar is missing records, has stale ones or carries appended changes
+        macaddr_index_save_nolock();
+    }
+}
+
+#pragma mark atomic writes
+/*
+ Group commit of file replacements.
+ Every writer puts its content into a temp file and queues it. Whoever finds no commit in progress
+ becomes the leader: it waits RECORD_COMMIT_WINDOW_MS for more writers to join, then syncs all queued
+ temp files, renames them over their destinations and syncs each directory once for the whole batch.
+ Writers arriving meanwhile are picked up by the next leader, so a burst of writes shares its syncs.
+ */
+struct pending_write{
+    int fd;
+    std::string tmppath;
+    std::string dst;
+    std::string dir;
+    bool done;
+    int err;                                        //errno of the failed step, 0 on success
+    uint64_t seq;                                   //order in which dst was replaced, set with done
+};
+static std::mutex gCommitLck;
+static std::condition_variable gCommitCond;
+static std::vector<pending_write*> gCommitQueue;    //guarded by gCommitLck
+static bool gCommitInProgress = false;              //guarded by gCommitLck
+static uint64_t gCommitSeq = 0;                     //guarded by gCommitLck
+static std::atomic<uint64_t> gCommitTmpCounter{0};
+
+static int sync_fd(int fd){
+#ifdef F_FULLFSYNC
+    //fsync on darwin doesn't flush the drive's cache
+    if (fcntl(fd, F_FULLFSYNC) == 0) return 0;
+#endif
+    return fsync(fd);
 }
 
+static void commit_batch(std::vector<pending_write*> &batch){
+    std::set<std::string> dirs;
+    for (auto w : batch) {
+        if (sync_fd(w->fd)) w->err = errno;
+    }
+    for (auto w : batch) {
+        if (!w->err && rename(w->tmppath.c_str(), w->dst.c_str())) w->err = errno;
+        if (!w->err) dirs.insert(w->dir);
+    }
+    for (auto &d : dirs) {
+        //persist the renames
+        int dirfd = -1;
+        if ((dirfd = open(d.c_str(), O_RDONLY | O_CLOEXEC)) != -1) {
+            sync_fd(dirfd);
+            close(dirfd);
+        }
+    }
+}
+
+/*
+ Replaces dst with buf. A crash leaves either the old or the new file, never a torn one.
+ If st is set, it receives the stat of the file which replaced dst.
+ Returns a sequence number, a later replacement of the same dst always gets a larger one.
+ */
+static uint64_t writeFileAtomic(const char *buf, size_t bufLen, const char *dst, struct stat *st){
+    pending_write w{-1, {}, dst, {}, false, 0, 0};
+    cleanup([&]{
+        safeClose(w.fd);
+        if (w.err && w.tmppath.size()) unlink(w.tmppath.c_str());
+    });
+    const char *name = strrchr(dst, '/');
+    w.dir = name ? std::string(dst, name-dst+1) : std::string("./");
+    name = name ? name+1 : dst;
+
+    //hidden, unique and without .plist suffix, so it's never taken for a record
+    w.tmppath = w.dir + "." + name + "." + std::to_string(getpid()) + "-" + std::to_string(++gCommitTmpCounter) + ".tmp";
+
+    w.err = EIO;
+    retassure((w.fd = open(w.tmppath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) != -1, "Failed to create %s: %s",w.tmppath.c_str(),strerror(errno));
+    for (size_t didWrite = 0; didWrite < bufLen;) {
+        ssize_t wr = write(w.fd, buf+didWrite, bufLen-didWrite);
+        if (wr < 0 && errno == EINTR) continue;
+        retassure(wr > 0, "Failed to write %s: %s",w.tmppath.c_str(),strerror(errno));
+        didWrite += wr;
+    }
+    if (st) retassure(!fstat(w.fd, st), "Failed to stat %s: %s",w.tmppath.c_str(),strerror(errno));
+    w.err = 0;
+
+    {
+        std::unique_lock<std::mutex> ul(gCommitLck);
+        gCommitQueue.push_back(&w);
+        while (!w.done) {
+            if (gCommitInProgress) {
+                gCommitCond.wait(ul);
+                continue;
+            }
+            std::vector<pending_write*> batch;
+            gCommitInProgress = true;
+            gCommitCond.wait_for(ul, std::chrono::milliseconds(RECORD_COMMIT_WINDOW_MS)); //let a burst of writers join
+            batch.swap(gCommitQueue);
+            ul.unlock();
+            commit_batch(batch);
+            ul.lock();
+            for (auto b : batch) {
+                //batch was renamed in queue order
+                b->seq = ++gCommitSeq;
+                b->done = true;
+            }
+            gCommitInProgress = false;
+            gCommitCond.notify_all();
+        }
+    }
+    retassure(!w.err, "Failed to replace %s: %s",dst,strerror(w.err));
+    return w.seq;
+}
 
-void writePlistToFile(plist_t plist, const char *dst){
+/*
+ Replaces dst with the XML encoding of plist, see writeFileAtomic()
+ */
+uint64_t writePlistToFile(plist_t plist, const char *dst, struct stat *st = NULL){
     char *buf = NULL;
-    FILE * saveFile = NULL;
     cleanup([&]{
         safeFree(buf);
-        safeFreeCustom(saveFile, fclose);
     });
     uint32_t bufLen = 0;
     plist_to_xml(plist, &buf, &bufLen);
-    
-    retassure(saveFile = fopen(dst, "w"), "Failed to write plist file to=%s",dst);
-    assure(fwrite(buf, 1, bufLen, saveFile) == bufLen);
+    retassure(buf, "Failed to encode plist for %s",dst);
+    return writeFileAtomic(buf, bufLen, dst, st);
+}
+
+#pragma mark system configuration
+/*
+ SystemConfiguration is read and parsed once, the daemon looks at the typed fields afterwards.
+ Changes are applied to a copy of dict which replaces the in-memory version once it was written to disk.
+ */
+struct system_config{
+    struct flag{
+        bool isSet;                                 //false if the key is missing or not a boolean
+        bool val;
+    };
+    bool didLoad;
+    plist_t dict;                                   //owned, written back as a whole
+    std::string systemBUID;                         //empty if missing or not a string
+    flag doPreflight;
+    flag enableWifiDeviceManager;
+    flag enableUSBDeviceManager;
+};
+static system_config gSystemConfig = {};
+static std::mutex gSystemConfigLck;                 //guards gSystemConfig
+
+static void sysconf_system_config_parse_nolock(){
+    auto parseFlag = [](const char *key) -> system_config::flag{
+        plist_t p_val = plist_dict_get_item(gSystemConfig.dict, key); //not owned
+        if (!p_val || plist_get_node_type(p_val) != PLIST_BOOLEAN) return {false, false};
+        return {true, (bool)plist_bool_val_is_true(p_val)};
+    };
+    plist_t p_buid = plist_dict_get_item(gSystemConfig.dict, CONFIG_SYSTEM_BUID_KEY); //not owned
+    const char *buid_str = NULL;
+    uint64_t buid_str_len = 0;
+
+    gSystemConfig.systemBUID.clear();
+    if (p_buid && plist_get_node_type(p_buid) == PLIST_STRING && (buid_str = plist_get_string_ptr(p_buid, &buid_str_len))) {
+        gSystemConfig.systemBUID = std::string(buid_str,buid_str_len);
+    }
+    gSystemConfig.doPreflight = parseFlag("doPreflight");
+    gSystemConfig.enableWifiDeviceManager = parseFlag("enableWifiDeviceManager");
+    gSystemConfig.enableUSBDeviceManager = parseFlag("enableUSBDeviceManager");
+}
+
+static plist_t sysconf_system_config_nolock(){
+    if (!gSystemConfig.didLoad) {
+        std::string filepath = get_device_record_path(CONFIG_FILE);
+        try {
+            gSystemConfig.dict = readPlist(filepath.c_str());
+            assure(plist_get_node_type(gSystemConfig.dict) == PLIST_DICT);
+        } catch (tihmstar::exception &e) {
+            warning("%s: Reading %s failed! Regenerating!",__func__,CONFIG_FILE);
+            safeFreeCustom(gSystemConfig.dict, plist_free);
+            gSystemConfig.dict = plist_new_dict();
+        }
+        sysconf_system_config_parse_nolock();
+        gSystemConfig.didLoad = true;
+    }
+    return gSystemConfig.dict;
 }
 
 plist_t sysconf_get_value(const std::string &key){
-    plist_t p_devrecord = NULL;
-    cleanup([&]{
-        safeFreeCustom(p_devrecord, plist_free);
-    });
+    std::unique_lock<std::mutex> ul(gSystemConfigLck);
     plist_t p_val = NULL;
-    std::string filepath = get_device_record_path(CONFIG_FILE);
-    
-    p_devrecord = readPlist(filepath.c_str());
-    
-    retassure(p_val = plist_dict_get_item(p_devrecord, key.c_str()), "Failed to get value for key '%s'",key.c_str());
+
+    retassure(p_val = plist_dict_get_item(sysconf_system_config_nolock(), key.c_str()), "Failed to get value for key '%s'",key.c_str());
 
     return plist_copy(p_val);
 }
 
-void sysconf_set_value(const std::string &key, plist_t val){
+static void sysconf_set_value_nolock(const std::string &key, plist_t val){
     plist_t p_sysconf = NULL;
     cleanup([&]{
         safeFreeCustom(p_sysconf, plist_free);
     });
     std::string filepath = get_device_record_path(CONFIG_FILE);
-    
-    try {
-        p_sysconf = readPlist(filepath.c_str());
-    } catch (tihmstar::exception &e) {
-        warning("%s: Reading %s failed! Regenerating!",__func__,CONFIG_FILE);
-        p_sysconf = plist_new_dict();
-    }
-    
+
+    p_sysconf = plist_copy(sysconf_system_config_nolock());
     plist_dict_set_item(p_sysconf, key.c_str(), plist_copy(val));
     writePlistToFile(p_sysconf, filepath.c_str());
+
+    std::swap(p_sysconf, gSystemConfig.dict);
+    sysconf_system_config_parse_nolock();
+}
+
+void sysconf_set_value(const std::string &key, plist_t val){
+    std::unique_lock<std::mutex> ul(gSystemConfigLck);
+    sysconf_set_value_nolock(key, val);
+}
+
+
+#pragma mark device record cache
+static void device_record_cache_invalidate_nolock(const std::string &udid){
+    if (udid.size()) {
+        gDeviceRecords.erase(udid);
+    } else {
+        gDeviceRecords.clear();
+    }
+    gDeviceRecordsEpoch++;
+}
+
+/*
+ Applies pending changes of the config dir to the cache.
+ returns false if the cache can't be trusted and records need to be read from disk
+ */
+static bool device_record_cache_sync_nolock(){
+#ifdef __APPLE__
+    return true;
+#else
+    if (!gDeviceRecordsDidInitWatch) {
+        gDeviceRecordsDidInitWatch = true;
+        sysconf_create_config_dir();
+        if ((gDeviceRecordsWatch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+            warning("Failed to init inotify, not caching pair records: %s",strerror(errno));
+            return false;
+        }
+        if (inotify_add_watch(gDeviceRecordsWatch, sysconf_get_config_dir(), IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) == -1) {
+            warning("Failed to watch %s, not caching pair records: %s",sysconf_get_config_dir(),strerror(errno));
+            safeClose(gDeviceRecordsWatch);
+            return false;
+        }
+    }
+    if (gDeviceRecordsWatch == -1) return false;
+
+    while (true) {
+        alignas(struct inotify_event) char buf[0x1000];
+        ssize_t got = read(gDeviceRecordsWatch, buf, sizeof(buf));
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0 && errno != EAGAIN) {
+                warning("Reading inotify events failed, not caching pair records anymore: %s",strerror(errno));
+                device_record_cache_invalidate_nolock("");
+                safeClose(gDeviceRecordsWatch);
+                return false;
+            }
+            break;
+        }
+        for (ssize_t off = 0; off < got; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)&buf[off];
+            off += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                //the directory itself is gone, it will be watched again once it's recreated
+                device_record_cache_invalidate_nolock("");
+                safeClose(gDeviceRecordsWatch);
+                gDeviceRecordsDidInitWatch = false;
+                return false;
+            } else if (ev->mask & IN_Q_OVERFLOW) {
+                device_record_cache_invalidate_nolock("");
+            } else if (ev->len) {
+                std::string name = ev->name;
+                if (name.size() > sizeof(".plist")-1 && name.compare(name.size()-(sizeof(".plist")-1), std::string::npos, ".plist") == 0) {
+                    device_record_cache_invalidate_nolock(name.substr(0, name.size()-(sizeof(".plist")-1)));
+                }
+            }
+        }
+    }
+    return true;
+#endif
 }
 
+static device_record_entry sysconf_get_device_record_entry(const char *udid){
+    device_record_entry ret{};
+    uint64_t epoch = 0;
+    bool useCache = false;
+    std::string filepath;
+#ifdef __APPLE__
+    struct stat st{};
+#endif
+
+    {
+        std::unique_lock<std::mutex> ul(gDeviceRecordsLck);
+        if ((useCache = device_record_cache_sync_nolock())) {
+            auto e = gDeviceRecords.find(udid);
+            if (e != gDeviceRecords.end()) {
+#ifdef __APPLE__
+                bool isValid = false;
+                std::string path = sysconf_get_config_dir();
+                path += '/';
+                path += udid;
+                path += ".plist";
+                if (stat(path.c_str(), &st)) {
+                    isValid = !e->second.record;
+                } else {
+                    isValid = e->second.record
+                        && st.st_ino == e->second.st.st_ino && st.st_size == e->second.st.st_size
+                        && st.st_mtimespec.tv_sec == e->second.st.st_mtimespec.tv_sec
+                        && st.st_mtimespec.tv_nsec == e->second.st.st_mtimespec.tv_nsec;
+                }
+                if (isValid) return e->second;
+#else
+                return e->second;
+#endif
+            }
+            epoch = gDeviceRecordsEpoch;
+        }
+    }
+
+    filepath = get_device_record_path(udid);
+#ifdef __APPLE__
+    if (stat(filepath.c_str(), &st)) st = {};
+#endif
+    try {
+        plist_t p_record = readPlist(filepath.c_str());
+        char *bin = NULL;
+        cleanup([&]{
+            safeFree(bin);
+        });
+        uint32_t binLen = 0;
+        ret.record = std::shared_ptr<void>(p_record, plist_free);
+        plist_to_bin(p_record, &bin, &binLen);
+        retassure(bin, "Failed to encode pair record of %s",udid);
+        ret.bin = std::make_shared<const std::string>(bin, binLen);
+#ifdef __APPLE__
+        ret.st = st;
+#endif
+    } catch (tihmstar::exception &e) {
+        ret = {};
+    }
+
+    if (useCache) {
+        std::unique_lock<std::mutex> ul(gDeviceRecordsLck);
+        //don't cache what we read if the record changed in the meantime
+        if (device_record_cache_sync_nolock() && epoch == gDeviceRecordsEpoch) {
+            gDeviceRecords[udid] = ret;
+        }
+    }
+    return ret;
+}
 
 plist_t sysconf_get_device_record(const char *udid){
-    std::string filepath = get_device_record_path(udid);
-    return readPlist(filepath.c_str());
+    if (gRecordStore) {
+        RecordStore::record bin = gRecordStore->get(udid);
+        plist_t p_record = NULL;
+        retassure(bin, "No pair record for %s",udid);
+        plist_from_bin(bin->data(), (uint32_t)bin->size(), &p_record);
+        retassure(p_record, "Failed to decode pair record of %s",udid);
+        return p_record;
+    }
+    device_record_entry e = sysconf_get_device_record_entry(udid);
+    retassure(e.record, "No pair record for %s",udid);
+    return plist_copy(e.record.get());
+}
+
+/*
+ the record in binary plist format, as clients get it from ReadPairRecord
+ */
+std::shared_ptr<const std::string> sysconf_get_device_record_bin(const char *udid){
+    if (gRecordStore) {
+        RecordStore::record bin = gRecordStore->get(udid);
+        retassure(bin, "No pair record for %s",udid);
+        return bin;
+    }
+    device_record_entry e = sysconf_get_device_record_entry(udid);
+    retassure(e.record, "No pair record for %s",udid);
+    return e.bin;
 }
 
 void sysconf_set_device_record(const char *udid, const plist_t record){
     assure(udid);
     assure(record);
+    if (gRecordStore) {
+        char *bin = NULL;
+        cleanup([&]{
+            safeFree(bin);
+        });
+        uint32_t binLen = 0;
+        std::string macaddr;
+        plist_to_bin(record, &bin, &binLen);
+        retassure(bin, "Failed to encode pair record of %s",udid);
+        try {
+            macaddr = record_macaddr(record);
+        } catch (tihmstar::exception &err) {
+            debug("record of %s has no macaddr",udid);
+        }
+        gRecordStore->set(udid, std::string(bin, binLen), macaddr);
+        return;
+    }
     std::string filepath = get_device_record_path(udid);
-    
-    writePlistToFile(record, filepath.c_str());
-    sysconf_load_known_macaddrs();
+    struct stat st{};
+    uint64_t seq = 0;
+
+    seq = writePlistToFile(record, filepath.c_str(), &st); //not under gDeviceRecordsLck, so concurrent writes share their syncs
+    {
+        std::unique_lock<std::mutex> ul(gDeviceRecordsLck);
+        device_record_cache_invalidate_nolock(udid);
+    }
+    {
+        std::unique_lock<std::mutex> ul(gKnownMacAddrsLck);
+        macaddr_entry e{};
+        if (!gKnownMacAddrsDidLoad) return; //picked up once the index is loaded
+        {
+            //a racing write of the same record may have replaced ours already
+            auto old = gMacAddrForUdid.find(udid);
+            if (old != gMacAddrForUdid.end() && old->second.commitSeq > seq) return;
+        }
+        //size and mtime of the file we wrote, so they always match the macaddr of record
+        e.size = st.st_size;
+        e.mtime = ST_MTIM(st);
+        e.commitSeq = seq;
+        try {
+            e.macaddr = record_macaddr(record);
+        } catch (tihmstar::exception &err) {
+            debug("record of %s has no macaddr",udid);
+        }
+        macaddr_index_set_nolock(udid, e);
+        macaddr_index_append_nolock(udid, &e);
+    }
 }
 
 void sysconf_remove_device_record(const char *udid){
+    if (gRecordStore) {
+        retassure(gRecordStore->remove(udid), "could not remove %s: no such record in %s", udid, gRecordStore->path().c_str());
+        return;
+    }
     std::string filepath = get_device_record_path(udid);
     
-    retassure(!remove(filepath.c_str()), "could not remove %s: %s", filepath.c_str(), strerror(errno));
-    sysconf_load_known_macaddrs();
+    {
+        std::unique_lock<std::mutex> ul(gDeviceRecordsLck);
+        retassure(!remove(filepath.c_str()), "could not remove %s: %s", filepath.c_str(), strerror(errno));
+        device_record_cache_invalidate_nolock(udid);
+    }
+    {
+        std::unique_lock<std::mutex> ul(gKnownMacAddrsLck);
+        if (!gKnownMacAddrsDidLoad) return;
+        macaddr_index_erase_nolock(udid);
+        macaddr_index_append_nolock(udid, NULL);
+    }
 }
 
 
 std::string sysconf_get_system_buid(){
-    plist_t p_buid = NULL;
-    cleanup([&]{
-        safeFreeCustom(p_buid, plist_free);
-    });
-    const char *buid_str = NULL;
-    uint64_t buid_str_len = 0;
-    
-    try {
-        p_buid = sysconf_get_value(CONFIG_SYSTEM_BUID_KEY);
-    } catch (tihmstar::exception &e) {
+    std::unique_lock<std::mutex> ul(gSystemConfigLck);
+
+    sysconf_system_config_nolock();
+    if (!gSystemConfig.systemBUID.size()) {
         warning("Failed to get SystemBuid! regenerating %s",CONFIG_FILE);
+        plist_t p_newbuid = NULL;
         char *buid_str = NULL;
         cleanup([&]{
             safeFree(buid_str);
+            safeFreeCustom(p_newbuid, plist_free);
         })
         assure(buid_str = sysconf_generate_system_buid());
-        p_buid = plist_new_string(buid_str);
-        sysconf_set_value(CONFIG_SYSTEM_BUID_KEY, p_buid);
+        p_newbuid = plist_new_string(buid_str);
+        sysconf_set_value_nolock(CONFIG_SYSTEM_BUID_KEY, p_newbuid);
+        retassure(gSystemConfig.systemBUID.size(), "Failed to store SystemBuid");
     }
-    
-    retassure(buid_str = plist_get_string_ptr(p_buid, &buid_str_len), "Failed to get str ptr from build");
-    
-    return std::string(buid_str,buid_str_len);
+    return gSystemConfig.systemBUID;
 }
 
 std::string sysconf_udid_for_macaddr(std::string macaddr){
-    if (!gKnownMacAddrs.size()){
-        sysconf_load_known_macaddrs();
+    if (gRecordStore) {
+        std::string udid = gRecordStore->udid_for_macaddr(macaddr);
+        retassure(udid.size(), "macaddr=%s is not paired",macaddr.c_str());
+        return udid;
+    }
+    std::unique_lock<std::mutex> ul(gKnownMacAddrsLck);
+    if (!gKnownMacAddrsDidLoad){
+        sysconf_load_known_macaddrs_nolock();
     }
-    try{
-        return gKnownMacAddrs.at(macaddr);
-    }catch (...){
-        reterror("macaddr=%s is not paired",macaddr.c_str());
+    auto m = gKnownMacAddrs.find(macaddr);
+    if (m == gKnownMacAddrs.end()) {
+        //records may have been added by someone else, which shows in the mtime of the config dir
+        struct stat dirst{};
+        if (!stat(sysconf_get_config_dir(), &dirst) && timespec_differ(ST_MTIM(dirst), gKnownMacAddrsDirMtime)) {
+            sysconf_load_known_macaddrs_nolock();
+            m = gKnownMacAddrs.find(macaddr);
+        }
     }
+    retassure(m != gKnownMacAddrs.end(), "macaddr=%s is not paired",macaddr.c_str());
+    return m->second;
 }
 
 void sysconf_fix_permissions(int uid, int gid){
@@ -328,24 +922,44 @@ void sysconf_fix_permissions(int uid, int gid){
             assure(!chown(path.c_str(), uid, gid));
         }
     }
+    if (gRecordStore) {
+        /*
+         The store may live outside of the config dir. Compaction creates <store>.tmp next to it
+         and renames it into place, so the dropped user needs the directory. We never hand over
+         a directory we didn't create, it has to belong to that user already.
+         */
+        const std::string &storePath = gRecordStore->path();
+        size_t slash = storePath.find_last_of('/');
+        std::string storeDir = (slash == std::string::npos) ? std::string(".") : (slash ? storePath.substr(0, slash) : std::string("/"));
+        struct stat st{};
+        retassure(!stat(storeDir.c_str(), &st), "Failed to stat %s: %s",storeDir.c_str(),strerror(errno));
+        retassure(st.st_uid == (uid_t)uid, "directory %s of record store %s must belong to uid %d",storeDir.c_str(),storePath.c_str(),uid);
+        gRecordStore->set_owner(uid, gid);
+    }
+}
+
+void sysconf_use_record_store(const std::string &path){
+    assure(!gRecordStore);
+    gRecordStore = new RecordStore(path);
 }
 
 #pragma mark config
-bool sysconf_try_getconfig_bool(std::string key, bool defaultValue){
+/*
+ returns the parsed value of key, or stores defaultValue if SystemConfiguration has no usable one
+ */
+static bool sysconf_getconfig_flag_nolock(system_config::flag system_config::*field, const char *key, bool defaultValue){
     plist_t p_boolVal = NULL;
     cleanup([&]{
         safeFreeCustom(p_boolVal, plist_free);
     });
-    try {
-        p_boolVal = sysconf_get_value(key);
-        assure(plist_get_node_type(p_boolVal) == PLIST_BOOLEAN);
-        return plist_bool_val_is_true(p_boolVal);
-    } catch (tihmstar::exception &e) {
-        warning("Failed to get %s! setting it to default val",key.c_str());
-        p_boolVal = plist_new_bool(defaultValue);
-        sysconf_set_value(key, p_boolVal);
-        return defaultValue;
-    }
+
+    sysconf_system_config_nolock();
+    if ((gSystemConfig.*field).isSet) return (gSystemConfig.*field).val;
+
+    warning("Failed to get %s! setting it to default val",key);
+    p_boolVal = plist_new_bool(defaultValue);
+    sysconf_set_value_nolock(key, p_boolVal);
+    return defaultValue;
 }
 
 Config::Config() :
@@ -358,15 +972,19 @@ enableUSBDeviceManager(false),
 enableExit(false),
 daemonize(false),
 useLogfile(false),
-debugLevel(0)
+debugLevel(0),
+tcpWorkers(0),
+usbRxDepthMax(0),
+clientOverflowCoalesce(false)
 {
     //empty
 }
 
 void Config::load(){
+    std::unique_lock<std::mutex> ul(gSystemConfigLck);
     //config
-    doPreflight = sysconf_try_getconfig_bool("doPreflight",true);
-    enableWifiDeviceManager = sysconf_try_getconfig_bool("enableWifiDeviceManager",true);
-    enableUSBDeviceManager = sysconf_try_getconfig_bool("enableUSBDeviceManager",true);
+    doPreflight = sysconf_getconfig_flag_nolock(&system_config::doPreflight, "doPreflight", true);
+    enableWifiDeviceManager = sysconf_getconfig_flag_nolock(&system_config::enableWifiDeviceManager, "enableWifiDeviceManager", true);
+    enableUSBDeviceManager = sysconf_getconfig_flag_nolock(&system_config::enableUSBDeviceManager, "enableUSBDeviceManager", true);
     info("Loaded config");
 }
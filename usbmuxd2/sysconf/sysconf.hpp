@@ -10,8 +10,10 @@
 
 #include <plist/plist.h>
 #include <iostream>
+#include <memory>
 
 plist_t sysconf_get_device_record(const char *udid);
+std::shared_ptr<const std::string> sysconf_get_device_record_bin(const char *udid);
 void sysconf_set_device_record(const char *udid, const plist_t record);
 void sysconf_remove_device_record(const char *udid);
 
@@ -19,6 +21,7 @@ std::string sysconf_get_system_buid();
 std::string sysconf_udid_for_macaddr(std::string macaddr);
 
 void sysconf_fix_permissions(int uid, int gid);
+void sysconf_use_record_store(const std::string &path);
 
 class Config{
 public:
@@ -33,9 +36,13 @@ public:
     bool daemonize;
     bool useLogfile;
     int debugLevel;
+    unsigned tcpWorkers;
+    unsigned usbRxDepthMax;
+    bool clientOverflowCoalesce;
     std::string dropUser;
     std::string connectIP;
     std::string pairRecordId;
+    std::string recordStore;
     
     Config();
     void load();
@@ -0,0 +1,156 @@
+//
+//  records.cpp
+//  usbmuxd2
+//
+
+#include "../sysconf/RecordStore.hpp"
+#include <libgeneral/macros.h>
+#include <plist/plist.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+#define CONFIG_FILE "SystemConfiguration"
+
+static void usage(const char *progname){
+    printf("Usage: %s COMMAND ARGS\n", progname);
+    printf("Convert pair records between a lockdown directory and a usbmuxd2 record store.\n\n");
+    printf("  import DIR STORE\tAdd all pair records from DIR to STORE, creating it if needed\n");
+    printf("  export STORE DIR\tWrite all pair records from STORE to DIR as <UDID>.plist\n");
+    printf("  list STORE\t\tPrint the UDIDs of all pair records in STORE\n");
+    printf("\n");
+}
+
+static std::string readFile(const std::string &path){
+    int fd = -1;
+    cleanup([&]{
+        safeClose(fd);
+    });
+    struct stat st{};
+    std::string ret;
+
+    retassure((fd = open(path.c_str(), O_RDONLY)) != -1, "Failed to open %s: %s",path.c_str(),strerror(errno));
+    retassure(!fstat(fd, &st), "Failed to stat %s: %s",path.c_str(),strerror(errno));
+    ret.resize(st.st_size);
+    retassure(read(fd, &ret[0], ret.size()) == (ssize_t)ret.size(), "Failed to read %s",path.c_str());
+    return ret;
+}
+
+static void writeFile(const std::string &path, const char *buf, size_t bufSize){
+    std::string tmppath = path + ".tmp";
+    int fd = -1;
+    cleanup([&]{
+        safeClose(fd);
+    });
+
+    retassure((fd = open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1, "Failed to create %s: %s",tmppath.c_str(),strerror(errno));
+    retassure(write(fd, buf, bufSize) == (ssize_t)bufSize, "Failed to write %s: %s",tmppath.c_str(),strerror(errno));
+    retassure(!fsync(fd), "Failed to sync %s: %s",tmppath.c_str(),strerror(errno));
+    retassure(!rename(tmppath.c_str(), path.c_str()), "Failed to move %s to %s: %s",tmppath.c_str(),path.c_str(),strerror(errno));
+}
+
+static void cmd_import(const char *dirpath, const char *storepath){
+    DIR *dir = NULL;
+    cleanup([&]{
+        safeFreeCustom(dir, closedir);
+    });
+    struct dirent *ent = NULL;
+    RecordStore store(storepath);
+    std::vector<RecordStore::import_record> records;
+    size_t imported = 0;
+
+    retassure(dir = opendir(dirpath), "Failed to open %s: %s",dirpath,strerror(errno));
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (ent->d_name[0] == '.' || len <= sizeof(".plist")-1 || strcmp(ent->d_name+len-(sizeof(".plist")-1), ".plist")) continue;
+        std::string udid(ent->d_name, len-(sizeof(".plist")-1));
+        if (udid == CONFIG_FILE) continue;
+
+        plist_t p_record = NULL;
+        char *bin = NULL;
+        cleanup([&]{
+            safeFree(bin);
+            safeFreeCustom(p_record, plist_free);
+        });
+        uint32_t binLen = 0;
+        std::string path = std::string(dirpath) + "/" + ent->d_name;
+        std::string buf = readFile(path);
+        std::string macaddr;
+        plist_t p_macaddr = NULL; //not owned
+
+        plist_from_memory(buf.data(), (uint32_t)buf.size(), &p_record, NULL);
+        if (!p_record || plist_get_node_type(p_record) != PLIST_DICT) {
+            warning("Skipping %s, it's not a pair record",path.c_str());
+            continue;
+        }
+        if ((p_macaddr = plist_dict_get_item(p_record, "WiFiMACAddress")) && plist_get_node_type(p_macaddr) == PLIST_STRING) {
+            const char *str = NULL;
+            uint64_t str_len = 0;
+            if ((str = plist_get_string_ptr(p_macaddr, &str_len))) macaddr = std::string(str, str_len);
+        }
+        plist_to_bin(p_record, &bin, &binLen);
+        retassure(bin, "Failed to encode pair record of %s",udid.c_str());
+        records.push_back({udid, std::string(bin, binLen), macaddr});
+    }
+    imported = records.size();
+    //one store rewrite for all of them, instead of a journal entry and sync per record
+    store.import(std::move(records));
+    printf("Imported %zu pair records into %s\n",imported,storepath);
+}
+
+static void cmd_export(const char *storepath, const char *dirpath){
+    RecordStore store(storepath);
+    unsigned exported = 0;
+
+    for (auto &udid : store.list()) {
+        plist_t p_record = NULL;
+        char *xml = NULL;
+        cleanup([&]{
+            safeFree(xml);
+            safeFreeCustom(p_record, plist_free);
+        });
+        uint32_t xmlLen = 0;
+        RecordStore::record bin = store.get(udid);
+        if (!bin) continue;
+
+        plist_from_bin(bin->data(), (uint32_t)bin->size(), &p_record);
+        retassure(p_record, "Failed to decode pair record of %s",udid.c_str());
+        plist_to_xml(p_record, &xml, &xmlLen);
+        retassure(xml, "Failed to encode pair record of %s",udid.c_str());
+        writeFile(std::string(dirpath) + "/" + udid + ".plist", xml, xmlLen);
+        exported++;
+    }
+    printf("Exported %u pair records to %s\n",exported,dirpath);
+}
+
+static void cmd_list(const char *storepath){
+    RecordStore store(storepath);
+    for (auto &udid : store.list()) {
+        printf("%s\n",udid.c_str());
+    }
+}
+
+int main(int argc, const char * argv[]) {
+    std::string cmd = (argc > 1) ? argv[1] : "";
+
+    try {
+        if (cmd == "import" && argc == 4) {
+            cmd_import(argv[2], argv[3]);
+        } else if (cmd == "export" && argc == 4) {
+            cmd_export(argv[2], argv[3]);
+        } else if (cmd == "list" && argc == 3) {
+            cmd_list(argv[2]);
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    } catch (tihmstar::exception &e) {
+        fatal("%s failed with error=%d (%s)",cmd.c_str(),e.code(),e.what());
+        return 1;
+    }
+    return 0;
+}